@@ -1339,8 +1339,10 @@ public:
    * @post `handle() == nullptr`
    */
   void commit() {
-    lmdb::txn_commit(_handle);
+    /* mdb_txn_commit() frees the handle even if it fails */
+    MDB_txn* const handle = _handle;
     _handle = nullptr;
+    lmdb::txn_commit(handle);
   }
 
   /**
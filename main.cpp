@@ -1,6 +1,10 @@
-#include "src/MicroCore.h"
 #include "src/CmdLineOptions.h"
+#include "src/BlockPipeline.h"
+#include "src/BlockchainWatcher.h"
+#include "src/RawChainReader.h"
 #include "src/mylmdb.h"
+#include "src/migrate.h"
+#include "src/OutputScanner.h"
 
 #include "ext/fmt/ostream.h"
 #include "ext/fmt/format.h"
@@ -29,12 +33,35 @@ int main(int ac, const char* av[])  {
     auto bc_path_opt          = opts.get_option<string>("bc-path");
     auto testnet_opt          = opts.get_option<bool>("testnet");
     auto search_opt           = opts.get_option<bool>("search");
+    auto migrate_opt          = opts.get_option<bool>("migrate");
+    auto follow_opt           = opts.get_option<bool>("follow");
+    auto poll_interval_opt    = opts.get_option<uint64_t>("poll-interval");
     auto no_confirmations_opt = opts.get_option<uint64_t>("no-confirmations");
+    auto blocks_per_txn_opt   = opts.get_option<uint64_t>("blocks-per-txn");
+    auto max_txn_size_opt     = opts.get_option<uint64_t>("max-txn-size");
+    auto max_txn_time_opt     = opts.get_option<uint64_t>("max-txn-time");
+    auto fetch_threads_opt    = opts.get_option<uint64_t>("fetch-threads");
+    auto key_image_filter_opt = opts.get_option<double>("key-image-filter");
+    auto build_snapshot_opt   = opts.get_option<uint64_t>("build-key-image-snapshot");
+    auto key_image_snap_opt   = opts.get_option<bool>("key-image-snapshot");
 
 
     bool testnet               = *testnet_opt;
     bool search_enabled        = *search_opt;
+    bool migrate               = *migrate_opt;
+    bool follow                = *follow_opt;
     uint64_t  no_confirmations = *no_confirmations_opt;
+    uint64_t  blocks_per_txn   = std::max<uint64_t>(*blocks_per_txn_opt, 1);
+    uint64_t  max_txn_size     = *max_txn_size_opt * 1024UL * 1024UL; // MiB to bytes
+    auto      max_txn_time     = std::chrono::seconds(*max_txn_time_opt);
+    size_t    fetch_threads    = *fetch_threads_opt;
+    double    key_image_fp     = *key_image_filter_opt;
+    bool      key_image_snap   = *key_image_snap_opt;
+
+    if (fetch_threads == 0)
+    {
+        fetch_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
 
     path blockchain_path;
 
@@ -51,16 +78,13 @@ int main(int ac, const char* av[])  {
     uint32_t log_level = 0;
     mlog_configure("", true);
 
-    // create instance of our MicroCore
-    // and make pointer to the Blockchain
-    xmreg::MicroCore mcore;
-    cryptonote::Blockchain* core_storage;
+    // reads blocks and txs directly from monerod's lmdb, and
+    // checks the current height of the blockchain
+    xmreg::RawChainReader chain {blockchain_path.string()};
 
-    // initialize mcore and core_storage
-    if (!xmreg::init_blockchain(blockchain_path.string(),
-                                mcore, core_storage))
+    if (!chain.is_open())
     {
-        cerr << "Error accessing blockchain." << endl;
+        cerr << "Cant open blockchain in " << blockchain_path << endl;
         return EXIT_FAILURE;
     }
 
@@ -83,68 +107,231 @@ int main(int ac, const char* av[])  {
         }
     }
 
-    // file in which last number of block analyzed is will be stored
-    path last_height_file =  mylmdb_location / path("last_height.txt");
+    if (migrate && !xmreg::migrate_custom_db(mylmdb_location,
+                                             chain, fetch_threads))
+    {
+        cerr << "Migration of " << mylmdb_location << " failed" << endl;
+        return EXIT_FAILURE;
+    }
 
     // instance of MyLMDB class that interacts with the custom database
     xmreg::MyLMDB mylmdb {mylmdb_location.string()};
 
+    if (mylmdb.schema_version() != xmreg::MyLMDB::SCHEMA_VERSION)
+    {
+        cerr << "Custom database in " << mylmdb_location
+             << " is in format version " << mylmdb.schema_version()
+             << ", but version " << xmreg::MyLMDB::SCHEMA_VERSION
+             << " is required. Run with --migrate to convert it." << endl;
+        return EXIT_FAILURE;
+    }
 
-    // the infinte loop that first reads all tx in the blockchain
-    // and then makes an interation every 60s to process new
-    // blockchain in the real time as they come
-    while (true)
+    if (key_image_fp > 0)
     {
+        if (key_image_fp >= 1)
+        {
+            cerr << "False positive rate of key image filter "
+                 << "must be less than 1" << endl;
+            return EXIT_FAILURE;
+        }
+
+        if (!mylmdb.enable_key_image_filter(key_image_fp))
+        {
+            cerr << "Cant set up filter of key images" << endl;
+            return EXIT_FAILURE;
+        }
+    }
 
-        string last_height_str = xmreg::read(last_height_file.string());
+    if (build_snapshot_opt)
+    {
+        cout << "Building snapshot of key images up to block "
+             << *build_snapshot_opt << endl;
 
-        if (!last_height_str.empty())
+        if (!mylmdb.build_key_image_snapshot(*build_snapshot_opt))
         {
-            boost::trim(last_height_str);
-            start_height = boost::lexical_cast<uint64_t>(last_height_str) + 1;
+            cerr << "Cant build snapshot of key images" << endl;
+            return EXIT_FAILURE;
         }
 
+        return EXIT_SUCCESS;
+    }
 
-        // get the current blockchain height. Just to check
-        uint64_t height =  xmreg::MyLMDB::get_blockchain_height(blockchain_path.string());
+    if (key_image_snap && !mylmdb.enable_key_image_snapshot())
+    {
+        cerr << "Cant load snapshot of key images" << endl;
+        return EXIT_FAILURE;
+    }
 
-        cout << "Current blockchain height: " << height << endl;
+    // height of last block analyzed used to be stored in
+    // last_height.txt file. If its there, move it to the database.
+    // If it cant be read, it is left as it is.
+    uint64_t last_height_from_file;
+
+    if (xmreg::read_last_height_file(mylmdb_location, last_height_from_file))
+    {
+        path last_height_file = mylmdb_location / path("last_height.txt");
+
+        if (!mylmdb.begin_txn()
+            || !mylmdb.write_checkpoint(last_height_from_file, cryptonote::null_hash)
+            || !mylmdb.end_txn())
+        {
+            cerr << "Cant save last height into the custom database" << endl;
+            return EXIT_FAILURE;
+        }
+
+        boost::filesystem::remove(last_height_file);
+    }
+
+    // many blocks are written in a single write transaction, as
+    // commits are the main cost of indexing. The height and hash
+    // of the last block written are saved in the same transaction,
+    // so they always match the data in the database.
+    bool         txn_open {false};
+    uint64_t     blocks_in_txn {0};
+    uint64_t     last_written_height {0};
+    crypto::hash last_written_hash {cryptonote::null_hash};
+
+    auto txn_started = std::chrono::steady_clock::now();
 
+    // blocks written in the current write transaction. Kept so that
+    // they can be written again if the database's map gets full.
+    vector<xmreg::block_data> pending_blocks;
 
-        for (uint64_t blk_height = start_height; blk_height < height - no_confirmations; ++blk_height)
+    auto write_block = [&](const xmreg::block_data& blk_data) -> bool
+    {
+        if (!mylmdb.write_block_timestamp(blk_data.height,
+                                          blk_data.blk.timestamp))
         {
-            cryptonote::block blk;
+            cerr << "write_block_timestamp failed in block "
+                 << blk_data.height << endl;
+            return false;
+        }
+
+        for (const xmreg::tx_record& tx_rec: blk_data.tx_records)
+        {
+            if (!mylmdb.write_tx(tx_rec))
+            {
+                cerr << "write_tx failed in tx " << tx_rec.tx_hash << endl;
+                return false;
+            }
+        }
+
+        return true;
+    };
 
-            try
+    // when the map is full, the write transaction is lost. So the
+    // map is grown, and the pending blocks are written again
+    // with this in a new transaction, until they fit.
+    auto write_pending_blocks = [&]() -> bool
+    {
+        for (const xmreg::block_data& pending_blk: pending_blocks)
+        {
+            if (!write_block(pending_blk))
             {
-                blk = core_storage->get_db().get_block_from_height(blk_height);
+                return false;
             }
-            catch (std::exception &e)
+        }
+
+        return true;
+    };
+
+    auto commit_blocks = [&]() -> bool
+    {
+        while (!mylmdb.write_checkpoint(last_written_height, last_written_hash)
+               || !mylmdb.end_txn())
+        {
+            if (!mylmdb.map_full()
+                || !mylmdb.grow_map_and_replay(write_pending_blocks))
             {
-                cout << e.what()
-                     << "Wait 60 seconds and try again ";
+                cerr << "commit failed" << endl;
+                return false;
+            }
+        }
+
+        txn_open = false;
+        pending_blocks.clear();
+
+        if (!mylmdb.update_key_image_filter())
+        {
+            cerr << "Cant update filter of key images" << endl;
+        }
+
+        return true;
+    };
 
-                for (size_t i = 0; i < 20; ++i)
-                {
-                    cout << "." << flush;
-                    std::this_thread::sleep_for(std::chrono::seconds(3));
-                }
 
-                cout << endl;
+    // in the follow mode, new blocks are processed as soon
+    // as they are added to the blockchain. Without it, nothing
+    // is watched, so no inotify descriptors are taken.
+    unique_ptr<xmreg::BlockchainWatcher> watcher;
 
-                continue;
+    if (follow)
+    {
+        watcher.reset(new xmreg::BlockchainWatcher(
+                blockchain_path.string(),
+                std::chrono::milliseconds(20),
+                std::chrono::milliseconds(*poll_interval_opt)));
+    }
+
+    // blocks are fetched and decoded by a number of worker
+    // threads, and written here, in the order of their heights,
+    // as lmdb allows for only one writer anyway. The same workers
+    // are used in all iterations of the loop below.
+    xmreg::BlockPipeline pipeline {chain, 0, 0,
+                                   fetch_threads, 16 * fetch_threads};
+
+    // the infinte loop that first reads all tx in the blockchain
+    // and then makes an interation every 60s (or when a new block
+    // comes in the follow mode) to process new blockchain
+    // in the real time as they come
+    while (true)
+    {
+
+        uint64_t     last_height;
+        crypto::hash last_blk_hash;
+
+        if (mylmdb.get_checkpoint(last_height, last_blk_hash))
+        {
+            crypto::hash blk_hash;
+
+            // make sure the last block analyzed is still in the blockchain
+            if (last_blk_hash != cryptonote::null_hash
+                && (!chain.get_block_hash(last_height, blk_hash)
+                    || last_blk_hash != blk_hash))
+            {
+                cerr << "Block " << last_height << " in the custom database "
+                     << "is not in the blockchain anymore" << endl;
+                return EXIT_FAILURE;
             }
 
-            // get all transactions in the block found
-            // initialize the first list with transaction for solving
-            // the block i.e. coinbase.
-            list<cryptonote::transaction> txs {blk.miner_tx};
-            list<crypto::hash> missed_txs;
+            start_height = last_height + 1;
+        }
+
+
+        // get the current blockchain height. Just to check
+        uint64_t height = chain.height();
+
+        cout << "Current blockchain height: " << height << endl;
+
+
+        uint64_t end_height = height > no_confirmations
+                              ? height - no_confirmations : 0;
+
+        pipeline.set_range(start_height, end_height);
+
+        xmreg::block_data blk_data;
 
-            if (!mcore.get_core().get_transactions(blk.tx_hashes, txs, missed_txs))
+        while (pipeline.pop(blk_data))
+        {
+            const uint64_t blk_height = blk_data.height;
+
+            if (!blk_data.error.empty())
             {
-                cerr << "Cant find transactions in block: " << height << endl;
-                return 1;
+                // block not available yet. Stop here and try
+                // again in the next iteration of the main loop
+                cerr << "Cant get block " << blk_height
+                     << ": " << blk_data.error << endl;
+                break;
             }
 
             if (blk_height % 1 == 0)
@@ -153,58 +340,51 @@ int main(int ac, const char* av[])  {
                            blk_height, height);
             }
 
-            if (!mylmdb.begin_txn())
+            if (!txn_open)
             {
-                cerr << "begin_txn failed" << endl;
-                return 1;
-            }
-            for (const cryptonote::transaction& tx : txs)
-            {
-                crypto::hash tx_hash = get_transaction_hash(tx);
-
-                if (!mylmdb.write_key_images(tx))
+                if (!mylmdb.begin_txn())
                 {
-                    cerr << "write_key_images failed in tx " << tx_hash << endl;
+                    cerr << "begin_txn failed" << endl;
                     return 1;
                 }
 
-                if (!mylmdb.write_output_public_keys(tx, blk))
-                {
-                    cerr << "write_output_public_keys failed in tx " << tx_hash << endl;
-                    return 1;
-                }
+                txn_open      = true;
+                blocks_in_txn = 0;
+                txn_started   = std::chrono::steady_clock::now();
+            }
 
-                if (!mylmdb.write_tx_public_key(tx))
-                {
-                    cerr << "write_tx_public_key failed in tx " << tx_hash << endl;
-                    return 1;
-                }
+            ++blocks_in_txn;
+            last_written_height = blk_height;
+            last_written_hash   = blk_data.blk_hash;
 
-                if (!mylmdb.write_payment_id(tx))
-                {
-                    cerr << "write_payment_id failed in tx " << tx_hash << endl;
-                    return 1;
-                }
+            // block is replayed together with the others
+            // if the map turns out to be full
+            pending_blocks.push_back(std::move(blk_data));
 
-                if (!mylmdb.write_encrypted_payment_id(tx))
-                {
-                    cerr << "write_payment_id failed in tx " << tx_hash << endl;
-                    return 1;
-                }
-            }
-            if (!mylmdb.end_txn())
+            if (!write_block(pending_blocks.back())
+                && !(mylmdb.map_full()
+                     && mylmdb.grow_map_and_replay(write_pending_blocks)))
             {
-                cerr << "end_txn failed" << endl;
                 return 1;
             }
 
-            // save the height of just analyzed block into the last_height_file
+            if (blocks_in_txn >= blocks_per_txn
+                || mylmdb.txn_size() >= max_txn_size
+                || std::chrono::steady_clock::now() - txn_started >= max_txn_time)
             {
-                ofstream out_file(last_height_file.string());
-                out_file << blk_height;
+                if (!commit_blocks())
+                {
+                    return 1;
+                }
             }
 
-        } // for (uint64_t i = start_height; i < height; ++i)
+        } // while (pipeline.pop(blk_data))
+
+        // commit what is left of the last batch of blocks
+        if (txn_open && !commit_blocks())
+        {
+            return 1;
+        }
 
         if (!mylmdb.sync())
         {
@@ -212,6 +392,15 @@ int main(int ac, const char* av[])  {
             return 1;
         }
 
+        xmreg::map_stats stats;
+
+        if (mylmdb.get_map_stats(stats))
+        {
+            fmt::print("Custom database map: {:d} MiB used, {:d} MiB free\n",
+                       stats.used / (1024 * 1024),
+                       stats.headroom() / (1024 * 1024));
+        }
+
         uint64_t what_to_search {0};
 
         if (search_enabled)
@@ -220,14 +409,16 @@ int main(int ac, const char* av[])  {
                  << "[0 - nothing, 1 - key_image, 2- out_public_key, "
                  << "3 - tx_public_key, 4 - payment id, 5 - encrypted payment id, "
                  << "6 - output info, 7 - block height based on timestamp, "
-                 << "8 - block heights withing timestamp range\""
+                 << "8 - block heights withing timestamp range, "
+                 << "9 - outputs withing block height range, "
+                 << "10 - outputs of an address\""
                  << endl;
-            cout << "Your choise [0-8]: ";
+            cout << "Your choise [0-10]: ";
             cin >> what_to_search;
         }
 
 
-        vector<string> found_txs;
+        vector<crypto::hash> found_txs;
 
         string to_search;
 
@@ -333,21 +524,13 @@ int main(int ac, const char* av[])  {
                 cin >> to_search;
                 cout << "Searching for: <" << to_search << ">" << endl;
 
-                // block timestamps are same as outputs obviously, so we
-                // can use this info for this purpose
                 uint64_t blk_timestamp = boost::lexical_cast<uint64_t>(to_search);
 
-                vector<xmreg::output_info> out_infos2;
+                uint64_t found_blk_height;
 
-                if (mylmdb.get_output_info(blk_timestamp, out_infos2))
+                if (mylmdb.height_at_or_after(blk_timestamp, found_blk_height))
                 {
-                    // since many outputs can be in a single block
-                    // just get the first one to obtained its block
-
-                    uint64_t found_blk_height = core_storage->get_db()
-                            .get_tx_block_height(out_infos2.at(0).tx_hash);
-
-                    cout << " - following timestamp was found for block no:"
+                    cout << " - first block with the timestamp or later is no:"
                          << found_blk_height
                          << endl;
                 }
@@ -367,24 +550,119 @@ int main(int ac, const char* av[])  {
                 cout << "Enter end block timestamp to find: ";
                 cin >> to_search_end;
 
-                // block timestamps are same as outputs obviously, so we
-                // can use this info for this purpose
                 uint64_t blk_timestamp_start = boost::lexical_cast<uint64_t>(to_search);
                 uint64_t blk_timestamp_end   = boost::lexical_cast<uint64_t>(to_search_end);
 
+                uint64_t blk_height_start, blk_height_end;
+
+                if (!mylmdb.height_range(blk_timestamp_start, blk_timestamp_end,
+                                         blk_height_start, blk_height_end))
+                {
+                    cout << "No blocks within the timestamp range were found."
+                         << endl;
+                    break;
+                }
+
+                cout << " - blocks from " << blk_height_start
+                     << " to " << blk_height_end - 1 << endl;
+
+                // outputs are printed directly from lmdb's pages
+                // while the read txn is held by the guard
+                xmreg::read_txn_guard guard = mylmdb.begin_read();
 
-                vector<pair<uint64_t, xmreg::output_info>> out_infos2;
+                for (const auto& out_rec: mylmdb.outputs_by_height_view(
+                        guard, blk_height_start, blk_height_end - 1))
+                {
+                    cout << "   - " << out_rec->info << endl;
+                }
+
+                break;
+            }
+            case 9:
+            {
+                cout << "Enter start block height: ";
+                cin >> to_search;
+
+                string to_search_end;
+                cout << "Enter end block height: ";
+                cin >> to_search_end;
+
+                uint64_t blk_height_start = boost::lexical_cast<uint64_t>(to_search);
+                uint64_t blk_height_end   = boost::lexical_cast<uint64_t>(to_search_end);
 
-                if (mylmdb.get_output_info_range(blk_timestamp_start, blk_timestamp_end, out_infos2))
+                xmreg::read_txn_guard guard = mylmdb.begin_read();
+
+                for (const auto& out_rec: mylmdb.outputs_by_height_view(
+                        guard, blk_height_start, blk_height_end))
                 {
-                    // since many outputs can be in a single block
-                    // just get the first one to obtained its block
+                    cout << "   - height: " << out_rec.key_as_uint64()
+                         << ", index: " << out_rec->index()
+                         << out_rec->info << endl;
+                }
+
+                break;
+            }
+            case 10:
+            {
+                string viewkey_str;
+                string start_height_str;
+
+                cout << "Enter address: ";
+                cin >> to_search;
+                cout << "Enter private viewkey: ";
+                cin >> viewkey_str;
+                cout << "Enter start block height: ";
+                cin >> start_height_str;
+
+                uint32_t no_major {1}, no_minor {1};
+
+                cout << "Enter number of subaddress accounts and "
+                     << "of subaddresses per account (e.g., 1 200): ";
+                cin >> no_major >> no_minor;
 
-                    for (const auto &out_info: out_infos2)
+                cryptonote::account_public_address address;
+                crypto::secret_key private_viewkey;
+
+                if (!xmreg::parse_str_address(to_search, address, testnet)
+                    || !xmreg::parse_str_secret_key(viewkey_str, private_viewkey))
+                {
+                    break;
+                }
+
+                uint64_t blk_height_start = boost::lexical_cast<uint64_t>(start_height_str);
+
+                xmreg::OutputScanner scanner {mylmdb, private_viewkey,
+                                              address.m_spend_public_key};
+
+                scanner.add_subaddresses(0, no_major, no_minor);
+
+                vector<xmreg::found_output> found_outputs;
+
+                // scan in parallel using as many threads
+                // as for fetching blocks
+                if (scanner.scan(blk_height_start,
+                                 std::numeric_limits<uint64_t>::max(),
+                                 found_outputs, fetch_threads))
+                {
+                    if (!scanner.decode_amounts(chain,
+                                                found_outputs, fetch_threads))
+                    {
+                        cerr << "Amounts of some RingCT outputs "
+                             << "could not be decoded" << endl;
+                    }
+
+                    cout << " - following outputs were found:" << endl;
+
+                    for (const xmreg::found_output& found_out: found_outputs)
                     {
-                        cout << "   - " << out_info.second << endl;
+                        cout << "   - height: " << found_out.blk_height
+                             << ", subaddress: " << found_out.subaddr_major
+                             << "/" << found_out.subaddr_minor
+                             << found_out.info << endl;
                     }
                 }
+
+                break;
             }
         } // switch (what_to_search)
 
@@ -392,11 +670,20 @@ int main(int ac, const char* av[])  {
         {
             cout << "Found " << found_txs.size() << " tx:" << endl;
 
-            for (const string& found_tx: found_txs)
+            for (const crypto::hash& found_tx: found_txs)
             {
-                fmt::print(" - tx hash: {:s}\n", found_tx);
+                fmt::print(" - tx hash: {:s}\n", pod_to_hex(found_tx));
             }
         }
+        else if (follow)
+        {
+            cout << "Wait for new block " << flush;
+
+            watcher->wait_for_new_block(height, [&]()
+            {
+                return chain.height();
+            });
+        }
         else
         {
             cout << "Wait for 60 seconds " << flush;
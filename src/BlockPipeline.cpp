@@ -0,0 +1,248 @@
+#include "BlockPipeline.h"
+
+namespace xmreg
+{
+
+    BlockPipeline::BlockPipeline(RawChainReader& _chain,
+                                 uint64_t _start_height,
+                                 uint64_t _end_height,
+                                 size_t _no_threads,
+                                 size_t _queue_size)
+            : m_chain {_chain},
+              m_end_height {_end_height},
+              m_queue_size {std::max<size_t>(_queue_size, 1)},
+              m_next_to_fetch {_start_height},
+              m_next_to_pop {_start_height},
+              m_stop {false},
+              m_generation {0}
+    {
+        _no_threads = std::max<size_t>(_no_threads, 1);
+
+        for (size_t i = 0; i < _no_threads; ++i)
+        {
+            m_workers.emplace_back(&BlockPipeline::worker, this);
+        }
+    }
+
+
+    /**
+     * Returns next block, in the order of heights.
+     *
+     * Blocks until the block is fetched by one of the workers.
+     * Returns false if there are no more blocks to return.
+     */
+    bool
+    BlockPipeline::pop(block_data& blk_data)
+    {
+        unique_lock<mutex> lock(m_mutex);
+
+        if (m_next_to_pop >= m_end_height)
+        {
+            return false;
+        }
+
+        m_can_pop.wait(lock, [&]()
+        {
+            return m_stop || m_ready.count(m_next_to_pop) > 0;
+        });
+
+        if (m_stop)
+        {
+            return false;
+        }
+
+        auto it = m_ready.find(m_next_to_pop);
+
+        blk_data = std::move(it->second);
+
+        m_ready.erase(it);
+
+        ++m_next_to_pop;
+
+        // there is space in the queue now
+        m_can_fetch.notify_all();
+
+        return true;
+    }
+
+
+    /**
+     * Sets heights of blocks to be fetched next. If start_height
+     * is where pop() already is, and the end is not lowered, the
+     * range is only extended, and blocks fetched so far are kept.
+     * Otherwise, e.g., after a block could not be fetched, or
+     * a reorganization of the blockchain, it starts over.
+     */
+    void
+    BlockPipeline::set_range(uint64_t start_height, uint64_t end_height)
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+
+            if (start_height != m_next_to_pop || end_height < m_end_height)
+            {
+                ++m_generation;
+
+                m_ready.clear();
+
+                m_next_to_fetch = start_height;
+                m_next_to_pop   = start_height;
+            }
+
+            m_end_height = end_height;
+        }
+
+        m_can_fetch.notify_all();
+    }
+
+
+    void
+    BlockPipeline::stop()
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_can_fetch.notify_all();
+        m_can_pop.notify_all();
+
+        for (thread& t: m_workers)
+        {
+            if (t.joinable())
+            {
+                t.join();
+            }
+        }
+    }
+
+
+    BlockPipeline::~BlockPipeline()
+    {
+        stop();
+    }
+
+
+    void
+    BlockPipeline::worker()
+    {
+        while (true)
+        {
+            block_data blk_data;
+
+            uint64_t generation;
+
+            {
+                unique_lock<mutex> lock(m_mutex);
+
+                // wait for blocks within the range, and
+                // dont run too far ahead of the consumer
+                m_can_fetch.wait(lock, [&]()
+                {
+                    return m_stop
+                           || (m_next_to_fetch < m_end_height
+                               && m_next_to_fetch < m_next_to_pop + m_queue_size);
+                });
+
+                if (m_stop)
+                {
+                    break;
+                }
+
+                blk_data.height = m_next_to_fetch++;
+                generation      = m_generation;
+            }
+
+            fetch_block(blk_data);
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+
+                // range started over while it was fetched
+                if (generation != m_generation)
+                {
+                    continue;
+                }
+
+                m_ready[blk_data.height] = std::move(blk_data);
+            }
+
+            m_can_pop.notify_all();
+        }
+
+        // frees the thread's slot in the reader table
+        m_chain.release_read_txn();
+    }
+
+
+    /**
+     * Get block and its transactions from the blockchain,
+     * and extract records of the transactions.
+     *
+     * RawChainReader gives each worker thread its own
+     * read txn, so they all read at the same time.
+     *
+     * Only prefixes of the txs are parsed, as that is all
+     * make_tx_record needs. Their hashes are in the block.
+     */
+    void
+    BlockPipeline::fetch_block(block_data& blk_data)
+    {
+        try
+        {
+            if (!m_chain.get_block(blk_data.height, blk_data.blk))
+            {
+                blk_data.error = "block not found";
+                return;
+            }
+
+            const block& blk = blk_data.blk;
+
+            blk_data.blk_hash = get_block_hash(blk);
+
+            blk_data.tx_records.reserve(blk.tx_hashes.size() + 1);
+
+            crypto::hash miner_tx_hash = get_transaction_hash(blk.miner_tx);
+
+            blk_data.tx_records.push_back(
+                    make_tx_record(blk.miner_tx, miner_tx_hash,
+                                   blk_data.height, blk.timestamp));
+
+            // with txs_pruned, txs of a block are read by their
+            // consecutive ids after its miner tx, and checked against
+            // tx_hashes, as their hashes come cheap from stored
+            // prunable hashes. Lookups by hash are used otherwise,
+            // or if they dont match, or for txs without RingCT.
+            uint64_t tx_id;
+
+            bool by_id = m_chain.has_pruned_layout()
+                         && m_chain.get_tx_id(miner_tx_hash, tx_id);
+
+            for (const crypto::hash& tx_hash: blk.tx_hashes)
+            {
+                transaction tx;
+
+                crypto::hash found_hash;
+
+                by_id = by_id
+                        && m_chain.get_tx_prefix(++tx_id, tx, found_hash)
+                        && found_hash == tx_hash;
+
+                if (!by_id && !m_chain.get_tx_prefix(tx_hash, tx))
+                {
+                    blk_data.error = "tx " + pod_to_hex(tx_hash) + " not found";
+                    return;
+                }
+
+                blk_data.tx_records.push_back(
+                        make_tx_record(tx, tx_hash, blk_data.height,
+                                       blk.timestamp));
+            }
+        }
+        catch (std::exception& e)
+        {
+            blk_data.error = e.what();
+        }
+    }
+
+}
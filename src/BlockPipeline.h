@@ -0,0 +1,110 @@
+#ifndef XMRLMDBCPP_BLOCKPIPELINE_H
+#define XMRLMDBCPP_BLOCKPIPELINE_H
+
+#include "monero_headers.h"
+#include "mylmdb.h"
+#include "RawChainReader.h"
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace xmreg
+{
+    using namespace cryptonote;
+    using namespace crypto;
+    using namespace std;
+
+    /**
+     * Block fetched and decoded from the blockchain, with
+     * records of its transactions ready to be written
+     * into the custom lmdb database.
+     */
+    struct block_data
+    {
+        uint64_t          height;
+        block             blk;
+        crypto::hash      blk_hash;
+
+        // coinbase tx is the first one
+        vector<tx_record> tx_records;
+
+        // non-empty if the block could not be fetched
+        string            error;
+    };
+
+
+    /**
+     * Fetches and decodes blocks from the blockchain using
+     * a number of worker threads, and hands them over
+     * to a single consumer (i.e., the lmdb writer) in
+     * the order of their heights.
+     *
+     * Workers are allowed to run ahead of the consumer
+     * by at most queue_size blocks.
+     *
+     * Workers wait for more blocks when they reach the end height,
+     * so one pipeline can be kept for the life of the program, with
+     * its range moved forward by set_range as the blockchain grows.
+     */
+    class BlockPipeline
+    {
+        RawChainReader& m_chain;
+
+        uint64_t m_end_height;
+        size_t   m_queue_size;
+
+        // height of next block to be fetched by a worker
+        uint64_t m_next_to_fetch;
+
+        // height of next block to be returned by pop()
+        uint64_t m_next_to_pop;
+
+        bool m_stop;
+
+        // changed whenever the range starts over, so that blocks
+        // fetched for the previous one are dropped
+        uint64_t m_generation;
+
+        // fetched blocks waiting to be returned, in order, by pop()
+        map<uint64_t, block_data> m_ready;
+
+        mutex m_mutex;
+        condition_variable m_can_fetch;
+        condition_variable m_can_pop;
+
+        vector<thread> m_workers;
+
+    public:
+        BlockPipeline(RawChainReader& _chain,
+                      uint64_t _start_height,
+                      uint64_t _end_height,
+                      size_t _no_threads,
+                      size_t _queue_size);
+
+        bool
+        pop(block_data& blk_data);
+
+        void
+        set_range(uint64_t start_height, uint64_t end_height);
+
+        void
+        stop();
+
+        virtual ~BlockPipeline();
+
+    private:
+
+        void
+        worker();
+
+        void
+        fetch_block(block_data& blk_data);
+    };
+
+}
+
+#endif //XMRLMDBCPP_BLOCKPIPELINE_H
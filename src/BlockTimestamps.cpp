@@ -0,0 +1,107 @@
+#include "BlockTimestamps.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace xmreg
+{
+
+    void
+    BlockTimestamps::push_back(uint64_t blk_timestamp)
+    {
+        uint32_t ts = static_cast<uint32_t>(
+                std::min<uint64_t>(blk_timestamp,
+                                   std::numeric_limits<uint32_t>::max()));
+
+        m_max_up_to.push_back(m_max_up_to.empty()
+                              ? ts : std::max(m_max_up_to.back(), ts));
+
+        m_timestamps.push_back(ts);
+        m_min_from.push_back(ts);
+
+        // the new block can lower the minimum of the blocks before it.
+        // Usually it does not, or only of a few last ones.
+        for (size_t i = m_min_from.size() - 1; i > 0; --i)
+        {
+            if (m_min_from[i - 1] <= ts)
+            {
+                break;
+            }
+
+            m_min_from[i - 1] = ts;
+        }
+    }
+
+
+    void
+    BlockTimestamps::reserve(size_t no_blocks)
+    {
+        m_timestamps.reserve(no_blocks);
+        m_max_up_to.reserve(no_blocks);
+        m_min_from.reserve(no_blocks);
+    }
+
+
+    uint64_t
+    BlockTimestamps::size() const
+    {
+        return m_timestamps.size();
+    }
+
+
+    uint64_t
+    BlockTimestamps::timestamp(uint64_t blk_height) const
+    {
+        return m_timestamps.at(blk_height);
+    }
+
+
+    /**
+     * Height of the first block with timestamp equal or
+     * greater than a given one, or size() if there is none.
+     */
+    uint64_t
+    BlockTimestamps::height_at_or_after(uint64_t timestamp) const
+    {
+        // first block whose running maximum reaches the timestamp,
+        // is also the first block whose own timestamp reaches it
+        auto it = std::lower_bound(m_max_up_to.begin(), m_max_up_to.end(),
+                                   timestamp,
+                                   [](uint32_t ts, uint64_t t)
+                                   {
+                                       return ts < t;
+                                   });
+
+        return static_cast<uint64_t>(it - m_max_up_to.begin());
+    }
+
+
+    /**
+     * Heights [first, second) of blocks spanning timestamps
+     * [timestamp_start, timestamp_end], i.e., from the first
+     * block with timestamp not earlier than timestamp_start,
+     * to the last block with timestamp not later than timestamp_end.
+     *
+     * The range is empty, i.e., first >= second,
+     * if there are no such blocks.
+     */
+    pair<uint64_t, uint64_t>
+    BlockTimestamps::height_range(uint64_t timestamp_start,
+                                  uint64_t timestamp_end) const
+    {
+        uint64_t first = height_at_or_after(timestamp_start);
+
+        // blocks from here on are all later than timestamp_end
+        auto it = std::upper_bound(m_min_from.begin(), m_min_from.end(),
+                                   timestamp_end,
+                                   [](uint64_t t, uint32_t ts)
+                                   {
+                                       return t < ts;
+                                   });
+
+        uint64_t second = static_cast<uint64_t>(it - m_min_from.begin());
+
+        return make_pair(first, std::max(first, second));
+    }
+
+}
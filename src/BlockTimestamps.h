@@ -0,0 +1,59 @@
+#ifndef XMRLMDBCPP_BLOCKTIMESTAMPS_H
+#define XMRLMDBCPP_BLOCKTIMESTAMPS_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace xmreg
+{
+    using namespace std;
+
+    /**
+     * Timestamps of all blocks, indexed by height, for finding
+     * heights of blocks from given times.
+     *
+     * Block timestamps are not increasing, e.g., a block can
+     * have earlier timestamp than its predecessor. So next to
+     * the timestamps, running maximum (from the first block)
+     * and running minimum (from the last block) are kept. Both
+     * are sorted, and can be binary searched.
+     *
+     * Timestamps are kept as 32-bit numbers, which is enough
+     * until 2106, to keep the arrays small.
+     */
+    class BlockTimestamps
+    {
+        vector<uint32_t> m_timestamps;
+
+        // maximum of timestamps of blocks 0..h
+        vector<uint32_t> m_max_up_to;
+
+        // minimum of timestamps of blocks h..last
+        vector<uint32_t> m_min_from;
+
+    public:
+
+        void
+        push_back(uint64_t blk_timestamp);
+
+        void
+        reserve(size_t no_blocks);
+
+        uint64_t
+        size() const;
+
+        uint64_t
+        timestamp(uint64_t blk_height) const;
+
+        uint64_t
+        height_at_or_after(uint64_t timestamp) const;
+
+        pair<uint64_t, uint64_t>
+        height_range(uint64_t timestamp_start,
+                     uint64_t timestamp_end) const;
+    };
+
+}
+
+#endif //XMRLMDBCPP_BLOCKTIMESTAMPS_H
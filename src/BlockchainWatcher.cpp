@@ -0,0 +1,109 @@
+#include "BlockchainWatcher.h"
+
+#include <thread>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace xmreg
+{
+
+    BlockchainWatcher::BlockchainWatcher(const string& _blockchain_path,
+                                         chrono::milliseconds _min_interval,
+                                         chrono::milliseconds _max_interval)
+            : m_data_file {_blockchain_path + "/data.mdb"},
+              m_min_interval {_min_interval},
+              m_max_interval {std::max(_min_interval, _max_interval)},
+              m_interval {_min_interval},
+              m_inotify_fd {-1},
+              m_watch_fd {-1}
+    {
+#ifdef __linux__
+        m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (m_inotify_fd >= 0)
+        {
+            m_watch_fd = inotify_add_watch(m_inotify_fd, m_data_file.c_str(),
+                                           IN_MODIFY);
+        }
+
+        if (m_watch_fd < 0)
+        {
+            cerr << "Cant watch " << m_data_file
+                 << " for changes. Only polling will be used." << endl;
+        }
+#endif
+    }
+
+
+    /**
+     * Blocks until the height returned by get_height
+     * is greater than current_height. Returns the new height.
+     */
+    uint64_t
+    BlockchainWatcher::wait_for_new_block(uint64_t current_height,
+                                          std::function<uint64_t()> get_height)
+    {
+        while (true)
+        {
+            uint64_t height = get_height();
+
+            if (height > current_height)
+            {
+                // blocks may come in bursts, e.g., when monerod
+                // syncs, so check often again for a while
+                m_interval = m_min_interval;
+                return height;
+            }
+
+            wait_for_change();
+
+            m_interval = std::min(m_interval * 2, m_max_interval);
+        }
+    }
+
+
+    /**
+     * Waits for data.mdb to be modified, but no
+     * longer than the current polling interval.
+     */
+    void
+    BlockchainWatcher::wait_for_change()
+    {
+#ifdef __linux__
+        if (m_watch_fd >= 0)
+        {
+            pollfd pfd {m_inotify_fd, POLLIN, 0};
+
+            if (poll(&pfd, 1, static_cast<int>(m_interval.count())) > 0)
+            {
+                // drain the events. We only care that
+                // something has changed.
+                char buf[4096];
+
+                while (read(m_inotify_fd, buf, sizeof(buf)) > 0)
+                {}
+            }
+
+            return;
+        }
+#endif
+        std::this_thread::sleep_for(m_interval);
+    }
+
+
+    BlockchainWatcher::~BlockchainWatcher()
+    {
+#ifdef __linux__
+        if (m_inotify_fd >= 0)
+        {
+            close(m_inotify_fd);
+        }
+#endif
+    }
+
+}
@@ -0,0 +1,57 @@
+#ifndef XMRLMDBCPP_BLOCKCHAINWATCHER_H
+#define XMRLMDBCPP_BLOCKCHAINWATCHER_H
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <functional>
+
+namespace xmreg
+{
+    using namespace std;
+
+    /**
+     * Waits for new blocks to be added to the blockchain.
+     *
+     * On linux, the blockchain's data.mdb is watched with inotify,
+     * so that a write by monerod wakes us up immediately. As monerod
+     * may write through a memory map (MDB_WRITEMAP), which does not
+     * trigger inotify events, the height is also polled in
+     * an adaptive interval: it starts at min_interval after a new
+     * block is found, and doubles up to max_interval while
+     * nothing changes.
+     */
+    class BlockchainWatcher
+    {
+        string m_data_file;
+
+        chrono::milliseconds m_min_interval;
+        chrono::milliseconds m_max_interval;
+        chrono::milliseconds m_interval;
+
+        // inotify descriptors. -1 if not used.
+        int m_inotify_fd;
+        int m_watch_fd;
+
+    public:
+        BlockchainWatcher(const string& _blockchain_path,
+                          chrono::milliseconds _min_interval
+                                = chrono::milliseconds(20),
+                          chrono::milliseconds _max_interval
+                                = chrono::milliseconds(1000));
+
+        uint64_t
+        wait_for_new_block(uint64_t current_height,
+                           std::function<uint64_t()> get_height);
+
+        virtual ~BlockchainWatcher();
+
+    private:
+
+        void
+        wait_for_change();
+    };
+
+}
+
+#endif //XMRLMDBCPP_BLOCKCHAINWATCHER_H
@@ -25,10 +25,30 @@ namespace xmreg
                  "path to lmdb blockchain")
                 ("no-confirmations,n", value<uint64_t>()->default_value(10),
                  "no of blocks before they are added to the custom lmdb")
+                ("blocks-per-txn", value<uint64_t>()->default_value(1000),
+                 "max no of blocks written in a single lmdb write transaction")
+                ("max-txn-size", value<uint64_t>()->default_value(256),
+                 "max size, in MiB, of data written in a single lmdb write transaction")
+                ("max-txn-time", value<uint64_t>()->default_value(30),
+                 "max time, in seconds, a single lmdb write transaction is kept open")
+                ("fetch-threads", value<uint64_t>()->default_value(0),
+                 "no of threads fetching and decoding blocks, 0 for no of cpu cores")
+                ("key-image-filter", value<double>()->default_value(0),
+                 "false positive rate, e.g., 0.01, of in-memory filter of key images checked before searching them, 0 to disable it")
+                ("build-key-image-snapshot", value<uint64_t>(),
+                 "save snapshot of key images up to a given block height, and exit")
+                ("key-image-snapshot",  value<bool>()->default_value(false)->implicit_value(true),
+                 "search key images in their snapshot, made with --build-key-image-snapshot, before the custom lmdb")
                 ("testnet,t",  value<bool>()->default_value(false)->implicit_value(true),
                  "is the address from testnet network")
                 ("search,s",  value<bool>()->default_value(false)->implicit_value(true),
-                 "search for tx from user input");
+                 "search for tx from user input")
+                ("follow,f",  value<bool>()->default_value(false)->implicit_value(true),
+                 "process new blocks as soon as they are added, instead of every 60s")
+                ("poll-interval", value<uint64_t>()->default_value(1000),
+                 "max time, in ms, between checks for new blocks in the follow mode")
+                ("migrate",  value<bool>()->default_value(false)->implicit_value(true),
+                 "convert custom lmdb to the current format before running");
 
 
         store(command_line_parser(acc, avv)
@@ -0,0 +1,277 @@
+#include "KeyImageFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace xmreg
+{
+
+    namespace
+    {
+        const char SNAPSHOT_MAGIC[8] = {'K', 'I', 'F', 'I', 'L', 'T', '0', '1'};
+
+        // fields are in the byte order of the machine
+        struct snapshot_header
+        {
+            char     magic[8];
+            uint64_t no_blocks;
+            uint64_t no_hashes;
+            uint64_t capacity;
+            double   fp_rate;
+
+            // key images in the database when saved
+            uint64_t no_keys;
+
+            uint64_t reserved[2];
+        };
+
+        static_assert(sizeof(snapshot_header) == 64,
+                      "blocks in snapshots must be aligned to 64 bytes");
+    }
+
+
+    KeyImageFilter::KeyImageFilter(uint64_t _capacity, double _fp_rate)
+            : m_capacity {std::max<uint64_t>(_capacity, 1)},
+              m_fp_rate {clamp_fp_rate(_fp_rate)},
+              m_words {nullptr}
+    {
+        const double ln2 = std::log(2.0);
+
+        // bits per key image of an ordinary Bloom filter
+        double bits_per_key = -std::log(m_fp_rate) / (ln2 * ln2);
+
+        m_no_hashes = std::min<uint64_t>(
+                std::max<uint64_t>(std::lround(bits_per_key * ln2), 1), 16);
+
+        // key images are not spread evenly over the blocks, which
+        // makes false positives a bit more frequent than in an
+        // ordinary Bloom filter. One more bit per key makes up for it.
+        bits_per_key = std::ceil(bits_per_key) + 1;
+
+        double no_bits = bits_per_key * static_cast<double>(m_capacity);
+
+        // block is picked from 32 bits of the key image
+        m_no_blocks = std::min<uint64_t>(
+                std::max<uint64_t>(std::ceil(no_bits / BLOCK_BITS), 1),
+                uint64_t {1} << 32);
+
+        allocate();
+    }
+
+
+    /**
+     * False positive rate the filter is actually built for,
+     * given the requested one.
+     */
+    double
+    KeyImageFilter::clamp_fp_rate(double fp_rate)
+    {
+        return std::min(std::max(fp_rate, 1e-9), 0.5);
+    }
+
+
+    void
+    KeyImageFilter::insert(const void* key_image)
+    {
+        uint64_t bit_hash, bit_step;
+
+        uint64_t* block = get_block(key_image, bit_hash, bit_step);
+
+        for (uint64_t i = 0; i < m_no_hashes; ++i)
+        {
+            uint64_t bit = bit_hash >> 55;
+
+            __atomic_fetch_or(&block[bit / 64], uint64_t {1} << (bit % 64),
+                              __ATOMIC_RELAXED);
+
+            bit_hash += bit_step;
+        }
+    }
+
+
+    /**
+     * False if the key image was never inserted.
+     */
+    bool
+    KeyImageFilter::might_contain(const void* key_image) const
+    {
+        uint64_t bit_hash, bit_step;
+
+        const uint64_t* block = get_block(key_image, bit_hash, bit_step);
+
+        for (uint64_t i = 0; i < m_no_hashes; ++i)
+        {
+            uint64_t bit = bit_hash >> 55;
+
+            uint64_t word = __atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED);
+
+            if ((word & (uint64_t {1} << (bit % 64))) == 0)
+            {
+                return false;
+            }
+
+            bit_hash += bit_step;
+        }
+
+        return true;
+    }
+
+
+    uint64_t
+    KeyImageFilter::capacity() const
+    {
+        return m_capacity;
+    }
+
+
+    double
+    KeyImageFilter::fp_rate() const
+    {
+        return m_fp_rate;
+    }
+
+
+    uint64_t
+    KeyImageFilter::size_in_bytes() const
+    {
+        return m_no_blocks * BLOCK_BITS / 8;
+    }
+
+
+    /**
+     * Saves the filter into a file, together with the number of
+     * key images in the database it was built from, so that it
+     * can be checked if the filter is still up to date when loaded.
+     *
+     * Must not be called while key images are being inserted.
+     * The file is first written under a temporary name, so a
+     * failed save does not overwrite the previous snapshot.
+     */
+    bool
+    KeyImageFilter::save(const string& file_path, uint64_t no_keys) const
+    {
+        snapshot_header header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+        header.no_blocks = m_no_blocks;
+        header.no_hashes = m_no_hashes;
+        header.capacity  = m_capacity;
+        header.fp_rate   = m_fp_rate;
+        header.no_keys   = no_keys;
+
+        string tmp_path = file_path + ".tmp";
+
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(m_words), size_in_bytes());
+
+            if (!out.flush())
+            {
+                cerr << "Cant write filter of key images into "
+                     << tmp_path << endl;
+                return false;
+            }
+        }
+
+        if (std::rename(tmp_path.c_str(), file_path.c_str()) != 0)
+        {
+            cerr << "Cant rename " << tmp_path << " to " << file_path << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Loads a filter saved with save(). Returns nullptr if there
+     * is no such file, or it is not a snapshot made with the current
+     * parameters of the filter, e.g., by an older version of
+     * the program. The filter must be then built again.
+     */
+    unique_ptr<KeyImageFilter>
+    KeyImageFilter::load(const string& file_path, uint64_t& no_keys)
+    {
+        std::ifstream in(file_path, std::ios::binary);
+
+        if (!in)
+        {
+            return nullptr;
+        }
+
+        snapshot_header header;
+
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        {
+            return nullptr;
+        }
+
+        unique_ptr<KeyImageFilter> filter {new KeyImageFilter(header.capacity,
+                                                              header.fp_rate)};
+
+        if (filter->m_no_blocks != header.no_blocks
+            || filter->m_no_hashes != header.no_hashes)
+        {
+            return nullptr;
+        }
+
+        if (!in.read(reinterpret_cast<char*>(filter->m_words),
+                     filter->size_in_bytes()))
+        {
+            return nullptr;
+        }
+
+        no_keys = header.no_keys;
+
+        return filter;
+    }
+
+
+    void
+    KeyImageFilter::allocate()
+    {
+        uint64_t no_words = m_no_blocks * WORDS_PER_BLOCK;
+
+        // extra words to align the first block to 64 bytes
+        m_buffer.reset(new uint64_t[no_words + WORDS_PER_BLOCK - 1]());
+
+        uintptr_t addr = reinterpret_cast<uintptr_t>(m_buffer.get());
+
+        m_words = reinterpret_cast<uint64_t*>((addr + 63) & ~uintptr_t {63});
+    }
+
+
+    /**
+     * Block in which the bits of a key image are, and the
+     * start and step of the bit positions within it.
+     */
+    uint64_t*
+    KeyImageFilter::get_block(const void* key_image,
+                              uint64_t& bit_hash,
+                              uint64_t& bit_step) const
+    {
+        uint64_t words[3];
+
+        memcpy(words, key_image, sizeof(words));
+
+        // maps 32 bits onto [0, m_no_blocks) without a division
+        uint64_t block_idx = ((words[0] >> 32) * m_no_blocks) >> 32;
+
+        bit_hash = words[1];
+
+        // odd, so it is never 0
+        bit_step = words[2] | 1;
+
+        return m_words + block_idx * WORDS_PER_BLOCK;
+    }
+
+}
@@ -0,0 +1,93 @@
+#ifndef XMRLMDBCPP_KEYIMAGEFILTER_H
+#define XMRLMDBCPP_KEYIMAGEFILTER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace xmreg
+{
+    using namespace std;
+
+    /**
+     * Blocked Bloom filter of key images, to answer that a key
+     * image is not in key_images, i.e., its output is not
+     * spent, without searching the database.
+     *
+     * The filter is split into blocks of 512 bits, i.e., of one
+     * cache line. All bits of a key image are set in one block,
+     * so checking a key image reads one cache line only.
+     *
+     * Key images are already uniformly distributed, so their
+     * bytes are used as hashes, without hashing them again.
+     *
+     * The filter can only give false positives, i.e., say that
+     * a key image may be in the database when it is not. How often
+     * it does, is set by fp_rate, for up to capacity key images.
+     *
+     * Snapshots saved into a file have a header of 64 bytes
+     * followed by the blocks, so they can also be memory-mapped.
+     *
+     * Key images can be inserted and checked by different threads
+     * at the same time. Bits are set and read atomically.
+     */
+    class KeyImageFilter
+    {
+    public:
+        static const size_t KEY_SIZE        = 32;  // bytes of key image
+        static const size_t BLOCK_BITS      = 512;
+        static const size_t WORDS_PER_BLOCK = BLOCK_BITS / 64;
+
+    private:
+        uint64_t m_capacity;
+        double   m_fp_rate;
+
+        uint64_t m_no_blocks;
+
+        // bits set for each key image
+        uint64_t m_no_hashes;
+
+        // allocated words, and the blocks in
+        // them, aligned to cache lines
+        unique_ptr<uint64_t[]> m_buffer;
+        uint64_t*              m_words;
+
+    public:
+        KeyImageFilter(uint64_t _capacity, double _fp_rate);
+
+        static double
+        clamp_fp_rate(double fp_rate);
+
+        void
+        insert(const void* key_image);
+
+        bool
+        might_contain(const void* key_image) const;
+
+        uint64_t
+        capacity() const;
+
+        double
+        fp_rate() const;
+
+        uint64_t
+        size_in_bytes() const;
+
+        bool
+        save(const string& file_path, uint64_t no_keys) const;
+
+        static unique_ptr<KeyImageFilter>
+        load(const string& file_path, uint64_t& no_keys);
+
+    private:
+
+        void
+        allocate();
+
+        uint64_t*
+        get_block(const void* key_image, uint64_t& bit_hash, uint64_t& bit_step) const;
+    };
+
+}
+
+#endif //XMRLMDBCPP_KEYIMAGEFILTER_H
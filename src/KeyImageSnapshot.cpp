@@ -0,0 +1,465 @@
+#include "KeyImageSnapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+namespace xmreg
+{
+
+    namespace
+    {
+        const char SNAPSHOT_MAGIC[8] = {'K', 'I', 'S', 'N', 'A', 'P', '0', '3'};
+
+        // key images per bucket, on average
+        const uint64_t AVG_BUCKET_SIZE = 4;
+
+        // pilots tried for a bucket, and seeds tried for
+        // all buckets, before giving up
+        const uint32_t MAX_PILOT = 1 << 20;
+        const uint64_t MAX_SEEDS = 8;
+
+        // fields are in the byte order of the machine
+        struct snapshot_header
+        {
+            char     magic[8];
+            uint64_t seed;
+            uint64_t no_keys;
+            uint64_t table_size;
+            uint64_t no_buckets;
+            uint64_t blk_height;
+            uint64_t tx_id_limit;
+            uint64_t reserved;
+            uint8_t  last_tx_hash[KeyImageSnapshot::HASH_SIZE];
+            uint8_t  reserved_2[32];
+        };
+
+        static_assert(sizeof(snapshot_header) == 128,
+                      "arrays in snapshots must be aligned to 64 bytes");
+
+        // finalizer of splitmix64
+        inline uint64_t
+        mix64(uint64_t x)
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ULL;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebULL;
+            x ^= x >> 31;
+
+            return x;
+        }
+
+        inline uint64_t
+        key_word(const void* key_image, size_t i)
+        {
+            uint64_t word;
+
+            memcpy(&word, static_cast<const uint8_t*>(key_image)
+                          + i * sizeof(uint64_t), sizeof(word));
+
+            return word;
+        }
+
+        template <typename T>
+        bool
+        read_array(std::ifstream& in, vector<T>& arr, uint64_t size)
+        {
+            arr.resize(size);
+
+            return static_cast<bool>(in.read(reinterpret_cast<char*>(arr.data()),
+                                             size * sizeof(T)));
+        }
+
+        template <typename T>
+        void
+        write_array(std::ofstream& out, const vector<T>& arr)
+        {
+            out.write(reinterpret_cast<const char*>(arr.data()),
+                      arr.size() * sizeof(T));
+        }
+    }
+
+
+    KeyImageSnapshot::KeyImageSnapshot(uint64_t _seed,
+                                       uint64_t _no_keys,
+                                       uint64_t _blk_height,
+                                       uint64_t _tx_id_limit,
+                                       const void* _last_tx_hash)
+            : m_seed {_seed},
+              m_no_keys {_no_keys},
+              m_table_size {_no_keys + _no_keys / 100 + 1},
+              m_no_buckets {_no_keys / AVG_BUCKET_SIZE + 1},
+              m_blk_height {_blk_height},
+              m_tx_id_limit {_tx_id_limit}
+    {
+        memcpy(m_last_tx_hash, _last_tx_hash, HASH_SIZE);
+    }
+
+
+    /**
+     * Builds snapshot of given key images, which must be all
+     * different, e.g., as read from key_images, with tx ids less
+     * than tx_id_limit, i.e., one more than the highest tx id of
+     * txs in the snapshot's blocks. last_tx_hash is hash of the tx of id
+     * tx_id_limit - 1, which identifies the database the snapshot
+     * is of. Returns nullptr if the hash could not be built.
+     */
+    unique_ptr<KeyImageSnapshot>
+    KeyImageSnapshot::build(const vector<entry>& entries,
+                            uint64_t blk_height,
+                            uint64_t tx_id_limit,
+                            const void* last_tx_hash)
+    {
+        // slots are indexed with 32-bit numbers
+        if (entries.size() >= std::numeric_limits<uint32_t>::max())
+        {
+            cerr << "Too many key images for a snapshot: "
+                 << entries.size() << endl;
+            return nullptr;
+        }
+
+        for (uint64_t seed = 0; seed < MAX_SEEDS; ++seed)
+        {
+            unique_ptr<KeyImageSnapshot> snapshot {
+                    new KeyImageSnapshot(seed, entries.size(),
+                                         blk_height, tx_id_limit,
+                                         last_tx_hash)};
+
+            if (snapshot->place_keys(entries))
+            {
+                return snapshot;
+            }
+        }
+
+        cerr << "Cant build perfect hash of key images. "
+             << "Are some of them repeated?" << endl;
+
+        return nullptr;
+    }
+
+
+    /**
+     * Finds id of the tx a key image is in. Returns false if
+     * the key image is not in the snapshot.
+     */
+    bool
+    KeyImageSnapshot::find(const void* key_image, uint64_t& tx_id) const
+    {
+        if (m_no_keys == 0)
+        {
+            return false;
+        }
+
+        uint64_t slot = get_position(key_image, m_pilots[get_bucket(key_image)]);
+
+        if (slot >= m_no_keys)
+        {
+            slot = m_remap[slot - m_no_keys];
+        }
+
+        if (memcmp(&m_key_images[slot * KEY_SIZE], key_image, KEY_SIZE) != 0)
+        {
+            return false;
+        }
+
+        tx_id = m_tx_ids[slot];
+
+        return true;
+    }
+
+
+    uint64_t
+    KeyImageSnapshot::size() const
+    {
+        return m_no_keys;
+    }
+
+
+    uint64_t
+    KeyImageSnapshot::blk_height() const
+    {
+        return m_blk_height;
+    }
+
+
+    uint64_t
+    KeyImageSnapshot::tx_id_limit() const
+    {
+        return m_tx_id_limit;
+    }
+
+
+    const uint8_t*
+    KeyImageSnapshot::last_tx_hash() const
+    {
+        return m_last_tx_hash;
+    }
+
+
+    /**
+     * The file is first written under a temporary name,
+     * so a failed save does not overwrite the previous snapshot.
+     */
+    bool
+    KeyImageSnapshot::save(const string& file_path) const
+    {
+        snapshot_header header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+        header.seed        = m_seed;
+        header.no_keys     = m_no_keys;
+        header.table_size  = m_table_size;
+        header.no_buckets  = m_no_buckets;
+        header.blk_height  = m_blk_height;
+        header.tx_id_limit = m_tx_id_limit;
+
+        memcpy(header.last_tx_hash, m_last_tx_hash, HASH_SIZE);
+
+        string tmp_path = file_path + ".tmp";
+
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+            // 64-bit array first, so all of them stay aligned
+            write_array(out, m_tx_ids);
+            write_array(out, m_key_images);
+            write_array(out, m_pilots);
+            write_array(out, m_remap);
+
+            if (!out.flush())
+            {
+                cerr << "Cant write snapshot of key images into "
+                     << tmp_path << endl;
+                return false;
+            }
+        }
+
+        if (std::rename(tmp_path.c_str(), file_path.c_str()) != 0)
+        {
+            cerr << "Cant rename " << tmp_path << " to " << file_path << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Loads a snapshot saved with save(). Returns nullptr
+     * if there is no such file, or it is not a snapshot.
+     */
+    unique_ptr<KeyImageSnapshot>
+    KeyImageSnapshot::load(const string& file_path)
+    {
+        std::ifstream in(file_path, std::ios::binary);
+
+        if (!in)
+        {
+            return nullptr;
+        }
+
+        snapshot_header header;
+
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        {
+            return nullptr;
+        }
+
+        unique_ptr<KeyImageSnapshot> snapshot {
+                new KeyImageSnapshot(header.seed, header.no_keys,
+                                     header.blk_height, header.tx_id_limit,
+                                     header.last_tx_hash)};
+
+        // made with different parameters of the hash
+        if (snapshot->m_table_size != header.table_size
+            || snapshot->m_no_buckets != header.no_buckets)
+        {
+            return nullptr;
+        }
+
+        if (!read_array(in, snapshot->m_tx_ids, header.no_keys)
+            || !read_array(in, snapshot->m_key_images, header.no_keys * KEY_SIZE)
+            || !read_array(in, snapshot->m_pilots, header.no_buckets)
+            || !read_array(in, snapshot->m_remap, header.table_size - header.no_keys))
+        {
+            return nullptr;
+        }
+
+        return snapshot;
+    }
+
+
+    /**
+     * Searches pilots for all the buckets, and fills the slots.
+     * False if some bucket has no pilot, with the current seed.
+     */
+    bool
+    KeyImageSnapshot::place_keys(const vector<entry>& entries)
+    {
+        // indices of entries, grouped by their buckets
+        vector<uint64_t> bucket_start(m_no_buckets + 1, 0);
+        vector<uint64_t> bucket_keys(m_no_keys);
+
+        vector<uint64_t> entry_bucket(m_no_keys);
+
+        for (uint64_t i = 0; i < m_no_keys; ++i)
+        {
+            entry_bucket[i] = get_bucket(entries[i].key_image);
+            ++bucket_start[entry_bucket[i] + 1];
+        }
+
+        std::partial_sum(bucket_start.begin(), bucket_start.end(),
+                         bucket_start.begin());
+
+        {
+            vector<uint64_t> next(bucket_start.begin(), bucket_start.end() - 1);
+
+            for (uint64_t i = 0; i < m_no_keys; ++i)
+            {
+                bucket_keys[next[entry_bucket[i]]++] = i;
+            }
+        }
+
+        auto bucket_size = [&](uint64_t b)
+        {
+            return bucket_start[b + 1] - bucket_start[b];
+        };
+
+        // largest buckets are the hardest to place,
+        // so they go first, while most slots are free
+        vector<uint64_t> order(m_no_buckets);
+
+        std::iota(order.begin(), order.end(), 0);
+
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint64_t a, uint64_t b)
+                         {
+                             return bucket_size(a) > bucket_size(b);
+                         });
+
+        m_pilots.assign(m_no_buckets, 0);
+
+        vector<bool> taken(m_table_size, false);
+
+        vector<uint64_t> positions;
+
+        for (uint64_t b: order)
+        {
+            if (bucket_size(b) == 0)
+            {
+                // rest of the buckets are empty as well
+                break;
+            }
+
+            bool placed {false};
+
+            for (uint32_t pilot = 0; pilot < MAX_PILOT && !placed; ++pilot)
+            {
+                positions.clear();
+
+                placed = true;
+
+                for (uint64_t k = bucket_start[b]; k < bucket_start[b + 1]; ++k)
+                {
+                    uint64_t pos = get_position(entries[bucket_keys[k]].key_image,
+                                                pilot);
+
+                    if (taken[pos] || std::find(positions.begin(), positions.end(),
+                                                pos) != positions.end())
+                    {
+                        placed = false;
+                        break;
+                    }
+
+                    positions.push_back(pos);
+                }
+
+                if (placed)
+                {
+                    for (uint64_t pos: positions)
+                    {
+                        taken[pos] = true;
+                    }
+
+                    m_pilots[b] = pilot;
+                }
+            }
+
+            if (!placed)
+            {
+                return false;
+            }
+        }
+
+        // there are as many free slots among the first m_no_keys,
+        // as there are key images in the extra slots
+        m_remap.assign(m_table_size - m_no_keys, 0);
+
+        uint64_t next_free {0};
+
+        for (uint64_t pos = m_no_keys; pos < m_table_size; ++pos)
+        {
+            if (!taken[pos])
+            {
+                continue;
+            }
+
+            while (taken[next_free])
+            {
+                ++next_free;
+            }
+
+            m_remap[pos - m_no_keys] = static_cast<uint32_t>(next_free++);
+        }
+
+        m_tx_ids.assign(m_no_keys, 0);
+        m_key_images.assign(m_no_keys * KEY_SIZE, 0);
+
+        for (uint64_t i = 0; i < m_no_keys; ++i)
+        {
+            const entry& e = entries[i];
+
+            uint64_t slot = get_position(e.key_image, m_pilots[entry_bucket[i]]);
+
+            if (slot >= m_no_keys)
+            {
+                slot = m_remap[slot - m_no_keys];
+            }
+
+            memcpy(&m_key_images[slot * KEY_SIZE], e.key_image, KEY_SIZE);
+            m_tx_ids[slot]       = e.tx_id;
+        }
+
+        return true;
+    }
+
+
+    uint64_t
+    KeyImageSnapshot::get_bucket(const void* key_image) const
+    {
+        uint64_t h = mix64(key_word(key_image, 0) ^ m_seed);
+
+        // maps 32 bits onto [0, m_no_buckets) without a division
+        return ((h >> 32) * m_no_buckets) >> 32;
+    }
+
+
+    uint64_t
+    KeyImageSnapshot::get_position(const void* key_image, uint32_t pilot) const
+    {
+        uint64_t h = mix64(key_word(key_image, 1) ^ m_seed);
+
+        return (h ^ mix64(pilot)) % m_table_size;
+    }
+
+}
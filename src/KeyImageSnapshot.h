@@ -0,0 +1,122 @@
+#ifndef XMRLMDBCPP_KEYIMAGESNAPSHOT_H
+#define XMRLMDBCPP_KEYIMAGESNAPSHOT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace xmreg
+{
+    using namespace std;
+
+    /**
+     * Immutable snapshot of key images, and ids of txs they are
+     * in, up to a given block height. Used by read-only nodes,
+     * to find key images without searching key_images.
+     *
+     * Key images are placed with a minimal perfect hash,
+     * i.e., each key image has its own slot in arrays of the
+     * same size as the number of key images. The slots hold
+     * whole key images, and their 64-bit tx ids.
+     *
+     * The hash is built as in PTHash. Key images are split into
+     * buckets of 4 on average, and for each bucket, largest first,
+     * a pilot is searched for which moves all its key images
+     * into slots not yet taken. The table has 1% more slots
+     * than key images, to make it quick to find pilots. Key
+     * images which end up in the extra slots are then moved into
+     * the free slots among the first ones.
+     *
+     * A lookup reads a pilot, a key image and a tx id. Any key
+     * image not in the snapshot also maps to some slot, so it is
+     * compared with the whole key image there, and found only
+     * if they are equal. Thus the answers are exact.
+     *
+     * Snapshots saved into a file are all fixed size arrays,
+     * after a header of 128 bytes, so they can also be memory-mapped.
+     */
+    class KeyImageSnapshot
+    {
+    public:
+        static const size_t KEY_SIZE  = 32;  // bytes of key image
+        static const size_t HASH_SIZE = 32;  // bytes of tx hash
+
+        struct entry
+        {
+            uint8_t  key_image[KEY_SIZE];
+            uint64_t tx_id;
+        };
+
+    private:
+        uint64_t m_seed;
+        uint64_t m_no_keys;
+        uint64_t m_table_size;
+        uint64_t m_no_buckets;
+
+        // last block height, and one more than
+        // the highest tx id of txs of its blocks
+        uint64_t m_blk_height;
+        uint64_t m_tx_id_limit;
+
+        // hash of the tx of id m_tx_id_limit - 1, so that a
+        // snapshot is not used with a database built again
+        uint8_t m_last_tx_hash[HASH_SIZE];
+
+        vector<uint64_t> m_tx_ids;
+        vector<uint8_t>  m_key_images;  // KEY_SIZE bytes per slot
+        vector<uint32_t> m_pilots;
+
+        // slots for positions from m_no_keys to m_table_size - 1
+        vector<uint32_t> m_remap;
+
+    public:
+
+        static unique_ptr<KeyImageSnapshot>
+        build(const vector<entry>& entries,
+              uint64_t blk_height,
+              uint64_t tx_id_limit,
+              const void* last_tx_hash);
+
+        bool
+        find(const void* key_image, uint64_t& tx_id) const;
+
+        uint64_t
+        size() const;
+
+        uint64_t
+        blk_height() const;
+
+        uint64_t
+        tx_id_limit() const;
+
+        const uint8_t*
+        last_tx_hash() const;
+
+        bool
+        save(const string& file_path) const;
+
+        static unique_ptr<KeyImageSnapshot>
+        load(const string& file_path);
+
+    private:
+
+        KeyImageSnapshot(uint64_t _seed,
+                         uint64_t _no_keys,
+                         uint64_t _blk_height,
+                         uint64_t _tx_id_limit,
+                         const void* _last_tx_hash);
+
+        bool
+        place_keys(const vector<entry>& entries);
+
+        uint64_t
+        get_bucket(const void* key_image) const;
+
+        uint64_t
+        get_position(const void* key_image, uint32_t pilot) const;
+    };
+
+}
+
+#endif //XMRLMDBCPP_KEYIMAGESNAPSHOT_H
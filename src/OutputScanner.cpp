@@ -0,0 +1,444 @@
+#include "OutputScanner.h"
+
+namespace xmreg
+{
+
+    namespace
+    {
+        // crypto::hash has std::hash, but no operator<,
+        // so (tx hash, account) pairs are kept in hash maps
+        struct tx_account_hash
+        {
+            size_t
+            operator()(const pair<crypto::hash, size_t>& tx_account) const
+            {
+                return std::hash<crypto::hash>()(tx_account.first)
+                       ^ (tx_account.second * 0x9e3779b97f4a7c15ULL);
+            }
+        };
+    }
+
+
+    OutputScanner::OutputScanner(MyLMDB& _db)
+            : m_db {_db}
+    {}
+
+
+    OutputScanner::OutputScanner(MyLMDB& _db,
+                                 const secret_key& _private_view_key,
+                                 const public_key& _public_spend_key)
+            : m_db {_db}
+    {
+        add_account(_private_view_key, _public_spend_key);
+    }
+
+
+    /**
+     * Adds an account to be scanned for.
+     * Returns its index, as used in found_output.
+     */
+    size_t
+    OutputScanner::add_account(const secret_key& private_view_key,
+                               const public_key& public_spend_key)
+    {
+        size_t account_idx = m_accounts.size();
+
+        m_accounts.push_back(scanned_account {private_view_key,
+                                              public_spend_key});
+
+        // if added twice, outputs are found for the first one only
+        m_spend_keys.emplace(public_spend_key,
+                             spend_key_owner {account_idx, 0, 0});
+
+        return account_idx;
+    }
+
+
+    /**
+     * Adds spend keys of subaddresses of an account, with major
+     * indices from 0 to no_major - 1, and minor indices from 0
+     * to no_minor - 1, so that outputs sent to them are found
+     * as well. The main address, i.e., 0/0, is already added
+     * by add_account.
+     */
+    void
+    OutputScanner::add_subaddresses(size_t account_idx,
+                                    uint32_t no_major,
+                                    uint32_t no_minor)
+    {
+        const scanned_account& account = m_accounts.at(account_idx);
+
+        m_spend_keys.reserve(m_spend_keys.size()
+                             + static_cast<size_t>(no_major) * no_minor);
+
+        for (uint32_t major = 0; major < no_major; ++major)
+        {
+            for (uint32_t minor = 0; minor < no_minor; ++minor)
+            {
+                if (major == 0 && minor == 0)
+                {
+                    continue;
+                }
+
+                m_spend_keys.emplace(
+                        get_subaddress_spend_key(account, major, minor),
+                        spend_key_owner {account_idx, major, minor});
+            }
+        }
+    }
+
+
+    size_t
+    OutputScanner::no_accounts() const
+    {
+        return m_accounts.size();
+    }
+
+
+    /**
+     * Decodes amounts and masks of RingCT outputs found by a scan,
+     * i.e., those with amount of 0. Their txs are read from the
+     * blockchain once each, and decoded in parallel, with one
+     * key derivation per tx and account.
+     *
+     * Returns false if any of the outputs could not be decoded.
+     * Their amounts are left as 0.
+     */
+    bool
+    OutputScanner::decode_amounts(RawChainReader& chain,
+                                  vector<found_output>& found_outputs,
+                                  size_t no_threads) const
+    {
+        // outputs to decode, grouped by their txs and accounts
+        unordered_map<pair<crypto::hash, size_t>, vector<size_t>,
+                      tx_account_hash> groups;
+
+        for (size_t i = 0; i < found_outputs.size(); ++i)
+        {
+            const found_output& found_out = found_outputs[i];
+
+            if (found_out.info.amount == 0)
+            {
+                groups[make_pair(found_out.info.tx_hash,
+                                 found_out.account_idx)].push_back(i);
+            }
+        }
+
+        vector<ringct_batch_tx>        batch_txs;
+        vector<const vector<size_t>*>  batch_outputs;
+
+        batch_txs.reserve(groups.size());
+        batch_outputs.reserve(groups.size());
+
+        for (const auto& group: groups)
+        {
+            const output_info& out_info = found_outputs[group.second.front()].info;
+
+            ringct_batch_tx batch_tx;
+
+            batch_tx.rv               = nullptr;
+            batch_tx.tx_pub_key       = out_info.tx_pub_key;
+            batch_tx.private_view_key = m_accounts[group.first.second].private_view_key;
+
+            for (size_t i: group.second)
+            {
+                batch_tx.output_indices.push_back(
+                        static_cast<unsigned int>(found_outputs[i].info.index_in_tx));
+            }
+
+            batch_txs.push_back(std::move(batch_tx));
+            batch_outputs.push_back(&group.second);
+        }
+
+        // read the txs in parallel as well
+        vector<transaction> txs(batch_txs.size());
+        atomic<bool> all_ok {true};
+
+        parallel_for(batch_txs.size(), no_threads,
+                     [&](size_t i)
+                     {
+                         const crypto::hash& tx_hash
+                                 = found_outputs[batch_outputs[i]->front()].info.tx_hash;
+
+                         // ecdhInfo is in the base of RingCT signatures
+                         if (!chain.get_tx_prefix(tx_hash, txs[i]))
+                         {
+                             cerr << "Cant get tx " << tx_hash << endl;
+                             all_ok = false;
+                         }
+                     },
+                     [&]()
+                     {
+                         chain.release_read_txn();
+                     });
+
+        if (!all_ok)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < batch_txs.size(); ++i)
+        {
+            batch_txs[i].rv = &txs[i].rct_signatures;
+        }
+
+        vector<ringct_decoded> decoded = decode_ringct_batch(batch_txs, no_threads);
+
+        // results are in the same order as outputs in batch_txs
+        size_t decoded_idx {0};
+
+        for (const vector<size_t>* outputs: batch_outputs)
+        {
+            for (size_t i: *outputs)
+            {
+                const ringct_decoded& dec = decoded[decoded_idx++];
+
+                if (!dec.decoded)
+                {
+                    all_ok = false;
+                    continue;
+                }
+
+                found_outputs[i].info.amount = dec.amount;
+                found_outputs[i].mask        = dec.mask;
+            }
+        }
+
+        return all_ok;
+    }
+
+
+    /**
+     * Scans outputs of blocks with heights in
+     * [blk_height_start, blk_height_end], which are
+     * already in the custom database.
+     *
+     * With more than one thread, the heights are split into
+     * chunks of chunk_size blocks. Each thread scans a chunk at
+     * a time, with its own read txn. Outputs found in the chunks
+     * are then joined in the order of the chunks, so they are
+     * in the same order as if scanned by one thread.
+     */
+    bool
+    OutputScanner::scan(uint64_t blk_height_start,
+                        uint64_t blk_height_end,
+                        vector<found_output>& found_outputs,
+                        size_t no_threads,
+                        uint64_t chunk_size)
+    {
+        uint64_t last_height;
+        crypto::hash last_blk_hash;
+
+        if (!m_db.get_checkpoint(last_height, last_blk_hash))
+        {
+            // nothing indexed yet
+            return true;
+        }
+
+        blk_height_end = std::min(blk_height_end, last_height);
+
+        if (blk_height_start > blk_height_end)
+        {
+            return true;
+        }
+
+        if (no_threads <= 1)
+        {
+            return scan_chunk(blk_height_start, blk_height_end, found_outputs);
+        }
+
+        chunk_size = std::max<uint64_t>(chunk_size, 1);
+
+        uint64_t no_chunks = (blk_height_end - blk_height_start) / chunk_size + 1;
+
+        vector<vector<found_output>> chunk_outputs(no_chunks);
+
+        atomic<bool> all_ok {true};
+
+        parallel_for(no_chunks, no_threads,
+                     [&](size_t chunk_idx)
+                     {
+                         uint64_t start = blk_height_start + chunk_idx * chunk_size;
+                         uint64_t end   = std::min(start + chunk_size - 1,
+                                                   blk_height_end);
+
+                         if (!scan_chunk(start, end, chunk_outputs[chunk_idx]))
+                         {
+                             all_ok = false;
+                         }
+                     },
+                     [&]()
+                     {
+                         // worker threads finish here, so
+                         // free their slots in the reader table
+                         m_db.release_read_txn();
+                     });
+
+        for (vector<found_output>& outputs: chunk_outputs)
+        {
+            found_outputs.insert(found_outputs.end(),
+                                 outputs.begin(), outputs.end());
+        }
+
+        return all_ok;
+    }
+
+
+    /**
+     * Scans outputs of blocks with heights in
+     * [blk_height_start, blk_height_end], in a single
+     * pass of a cursor over output_info_by_height.
+     */
+    bool
+    OutputScanner::scan_chunk(uint64_t blk_height_start,
+                              uint64_t blk_height_end,
+                              vector<found_output>& found_outputs)
+    {
+        const size_t no_accounts = m_accounts.size();
+
+        // tx public key of the previous output,
+        // and derivations computed for it for each account
+        public_key             last_tx_pub_key {null_pkey};
+        vector<key_derivation> derivations(no_accounts);
+        vector<char>           derivations_ok(no_accounts, false);
+
+        public_key spend_key;
+
+        try
+        {
+            read_txn_guard guard = m_db.begin_read();
+
+            for (const mdb_view<output_record>& out_rec:
+                    m_db.outputs_by_height_view(guard,
+                                                blk_height_start,
+                                                blk_height_end))
+            {
+                const output_info& out_info = out_rec->info;
+
+                if (out_info.tx_pub_key != last_tx_pub_key)
+                {
+                    last_tx_pub_key = out_info.tx_pub_key;
+
+                    for (size_t i = 0; i < no_accounts; ++i)
+                    {
+                        // e.g., txs without public keys cant be ours
+                        derivations_ok[i] = out_info.tx_pub_key != null_pkey
+                                            && generate_key_derivation(
+                                                    out_info.tx_pub_key,
+                                                    m_accounts[i].private_view_key,
+                                                    derivations[i]);
+                    }
+                }
+
+                for (size_t i = 0; i < no_accounts; ++i)
+                {
+                    if (!derivations_ok[i])
+                    {
+                        continue;
+                    }
+
+                    derive_spend_key(out_info, derivations[i], spend_key);
+
+                    auto it = m_spend_keys.find(spend_key);
+
+                    // spend key must be of the account whose
+                    // view key was used for the derivation
+                    if (it == m_spend_keys.end() || it->second.account_idx != i)
+                    {
+                        continue;
+                    }
+
+                    found_outputs.push_back(found_output {i,
+                                                          it->second.subaddr_major,
+                                                          it->second.subaddr_minor,
+                                                          out_rec.key_as_uint64(),
+                                                          out_rec->index(),
+                                                          out_info});
+
+                    // output can belong to only one account
+                    break;
+                }
+            }
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Output's public key is P = Hs(derivation || index)G + B,
+     * where B is the spend key of its owner. So the spend key
+     * is B = P - Hs(derivation || index)G, which can be looked
+     * up among spend keys of all accounts at once, instead of
+     * computing P for each of them.
+     */
+    void
+    OutputScanner::derive_spend_key(const output_info& out_info,
+                                    const key_derivation& derivation,
+                                    public_key& spend_key)
+    {
+        crypto::secret_key scalar;
+
+        crypto::derivation_to_scalar(derivation, out_info.index_in_tx, scalar);
+
+        rct::key spend_key_rct;
+
+        rct::subKeys(spend_key_rct,
+                     rct::pk2rct(out_info.out_pub_key),
+                     rct::scalarmultBase(rct::sk2rct(scalar)));
+
+        spend_key = rct::rct2pk(spend_key_rct);
+    }
+
+
+
+    /**
+     * Spend key of a subaddress, D = B + Hs("SubAddr" || a || major || minor)G,
+     * where a is the private view key, and B is the public spend key,
+     * with the indices as 32-bit little-endian numbers.
+     */
+    public_key
+    OutputScanner::get_subaddress_spend_key(const scanned_account& account,
+                                            uint32_t major,
+                                            uint32_t minor)
+    {
+        // includes the terminating 0
+        static const char prefix[] = "SubAddr";
+
+        char data[sizeof(prefix) + sizeof(secret_key) + 2 * sizeof(uint32_t)];
+
+        char* pos = data;
+
+        memcpy(pos, prefix, sizeof(prefix));
+        pos += sizeof(prefix);
+
+        memcpy(pos, &account.private_view_key, sizeof(secret_key));
+        pos += sizeof(secret_key);
+
+        for (uint32_t idx: {major, minor})
+        {
+            for (size_t i = 0; i < sizeof(uint32_t); ++i)
+            {
+                *pos++ = static_cast<char>((idx >> (8 * i)) & 0xff);
+            }
+        }
+
+        crypto::secret_key m;
+
+        crypto::hash_to_scalar(data, sizeof(data), m);
+
+        rct::key spend_key_rct;
+
+        rct::addKeys(spend_key_rct,
+                     rct::pk2rct(account.public_spend_key),
+                     rct::scalarmultBase(rct::sk2rct(m)));
+
+        return rct::rct2pk(spend_key_rct);
+    }
+
+}
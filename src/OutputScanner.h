@@ -0,0 +1,160 @@
+#ifndef XMRLMDBCPP_OUTPUTSCANNER_H
+#define XMRLMDBCPP_OUTPUTSCANNER_H
+
+#include "monero_headers.h"
+#include "mylmdb.h"
+#include "RawChainReader.h"
+#include "parallel.h"
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+namespace xmreg
+{
+    using namespace cryptonote;
+    using namespace crypto;
+    using namespace std;
+
+    /**
+     * Address scanned for its outputs, given by its private
+     * view key and public spend key, i.e., view-only account.
+     */
+    struct scanned_account
+    {
+        secret_key private_view_key;
+        public_key public_spend_key;
+    };
+
+
+    /**
+     * Output found to belong to one of the scanned accounts.
+     */
+    struct found_output
+    {
+        // index of the account, as returned by add_account
+        size_t      account_idx;
+
+        // subaddress the output was sent to. 0/0 is the main address
+        uint32_t    subaddr_major;
+        uint32_t    subaddr_minor;
+
+        uint64_t    blk_height;
+
+        // index of the output in output_info_by_height
+        uint64_t    output_index;
+
+        // amount of a RingCT output is 0,
+        // until set by decode_amounts
+        output_info info;
+
+        // mask of a RingCT output, set by decode_amounts
+        rct::key    mask;
+    };
+
+
+    /**
+     * Account, and its subaddress, to which a spend key belongs.
+     */
+    struct spend_key_owner
+    {
+        size_t   account_idx;
+        uint32_t subaddr_major;
+        uint32_t subaddr_minor;
+    };
+
+
+    /**
+     * Finds outputs belonging to addresses using only their
+     * private view keys and public spend keys, like
+     * get_belonging_outputs, but over output_info_by_height
+     * rather than over blocks and txs read from the blockchain.
+     *
+     * Any number of accounts is scanned in the same pass over
+     * the dbi. For each tx, a key derivation is computed for each
+     * account. Then, for each output and account, the spend key
+     * the output would have been sent to is derived from the
+     * output's public key, and looked up in a hash map of spend
+     * keys of all the accounts.
+     *
+     * The map can also hold spend keys of accounts' subaddresses,
+     * computed up front for a given number of them. Each output
+     * is then still checked with one subtraction and one lookup
+     * per account, however many subaddresses there are.
+     *
+     * Outputs of a tx are next to each other in the dbi,
+     * so the key derivations are computed once per tx public
+     * key, and reused for the tx's other outputs.
+     *
+     * Amounts of RingCT outputs are 0, as they are encrypted
+     * in the txs, and not stored in the custom database.
+     * decode_amounts reads the txs of found outputs from the
+     * blockchain, and decrypts them.
+     *
+     * Range of heights can be split into chunks
+     * scanned in parallel by a number of threads.
+     */
+    class OutputScanner
+    {
+        static const uint64_t DEFAULT_CHUNK_SIZE = 1000; // blocks
+
+        MyLMDB& m_db;
+
+        vector<scanned_account> m_accounts;
+
+        // spend keys of all accounts and their subaddresses
+        unordered_map<public_key, spend_key_owner> m_spend_keys;
+
+    public:
+        explicit OutputScanner(MyLMDB& _db);
+
+        OutputScanner(MyLMDB& _db,
+                      const secret_key& _private_view_key,
+                      const public_key& _public_spend_key);
+
+        size_t
+        add_account(const secret_key& private_view_key,
+                    const public_key& public_spend_key);
+
+        void
+        add_subaddresses(size_t account_idx,
+                         uint32_t no_major,
+                         uint32_t no_minor);
+
+        size_t
+        no_accounts() const;
+
+        bool
+        decode_amounts(RawChainReader& chain,
+                       vector<found_output>& found_outputs,
+                       size_t no_threads = 1) const;
+
+        static public_key
+        get_subaddress_spend_key(const scanned_account& account,
+                                 uint32_t major,
+                                 uint32_t minor);
+
+        bool
+        scan(uint64_t blk_height_start,
+             uint64_t blk_height_end,
+             vector<found_output>& found_outputs,
+             size_t no_threads = 1,
+             uint64_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+        static void
+        derive_spend_key(const output_info& out_info,
+                         const key_derivation& derivation,
+                         public_key& spend_key);
+
+    private:
+
+        bool
+        scan_chunk(uint64_t blk_height_start,
+                   uint64_t blk_height_end,
+                   vector<found_output>& found_outputs);
+    };
+
+}
+
+#endif //XMRLMDBCPP_OUTPUTSCANNER_H
@@ -0,0 +1,712 @@
+#include "RawChainReader.h"
+
+#include <cstddef>
+#include <cstring>
+
+namespace xmreg
+{
+
+    namespace
+    {
+        // values of block_info and tx_indices, as in monero's
+        // db_lmdb.cpp, in version 1 of its database
+
+        struct mdb_block_info
+        {
+            uint64_t     bi_height;
+            uint64_t     bi_timestamp;
+            uint64_t     bi_coins;
+            uint64_t     bi_size;
+            uint64_t     bi_diff;
+            crypto::hash bi_hash;
+        };
+
+        struct mdb_txindex
+        {
+            crypto::hash key;
+            uint64_t     tx_id;
+            uint64_t     unlock_time;
+            uint64_t     block_id;
+        };
+
+        // all values of block_info and tx_indices are dups of this key
+        const uint64_t ZERO_KEY {0};
+
+        // versions of monerod's database whose layouts are known.
+        // Version 0 has no dups in block_info and tx_indices,
+        // and version 5 adds bi_diff_hi before bi_hash.
+        const uint32_t MIN_DB_VERSION {1};
+        const uint32_t MAX_DB_VERSION {5};
+
+        size_t
+        block_hash_offset(uint32_t db_version)
+        {
+            return db_version >= 5
+                   ? offsetof(mdb_block_info, bi_hash) + sizeof(uint64_t)
+                   : offsetof(mdb_block_info, bi_hash);
+        }
+
+        // comparators of dups, same as in db_lmdb.cpp. lmdb does
+        // not store them in the database, so they must be set
+        // by every process reading it.
+
+        int
+        compare_uint64(const MDB_val* a, const MDB_val* b)
+        {
+            uint64_t va, vb;
+
+            memcpy(&va, a->mv_data, sizeof(va));
+            memcpy(&vb, b->mv_data, sizeof(vb));
+
+            return (va < vb) ? -1 : va > vb;
+        }
+
+        int
+        compare_hash32(const MDB_val* a, const MDB_val* b)
+        {
+            uint32_t va[8], vb[8];
+
+            memcpy(va, a->mv_data, sizeof(va));
+            memcpy(vb, b->mv_data, sizeof(vb));
+
+            for (int n = 7; n >= 0; n--)
+            {
+                if (va[n] == vb[n])
+                {
+                    continue;
+                }
+
+                return va[n] < vb[n] ? -1 : 1;
+            }
+
+            return 0;
+        }
+    }
+
+
+    RawChainReader::RawChainReader(const string& _blockchain_path)
+            : m_blockchain_path {_blockchain_path},
+              m_env {nullptr},
+              m_blocks {0}, m_block_info {0}, m_txs {0}, m_tx_indices {0},
+              m_txs_pruned {0}, m_txs_prunable {0}, m_txs_prunable_hash {0},
+              m_pruned_layout {false},
+              m_db_version {0},
+              m_open {false}
+    {
+        m_open = open();
+    }
+
+
+    bool
+    RawChainReader::open()
+    {
+        try
+        {
+            m_env = lmdb::env::create();
+            m_env.set_max_dbs(32);
+
+            // MDB_NOTLS, as txns of the pool are
+            // tied to threads by the pool itself
+            m_env.open(m_blockchain_path.c_str(), MDB_RDONLY | MDB_NOTLS, 0664);
+
+            // dbis opened in a read-only transaction become
+            // available to other transactions once that
+            // transaction is committed
+            lmdb::txn txn = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+
+            m_blocks     = lmdb::dbi::open(txn, "blocks");
+            m_block_info = lmdb::dbi::open(txn, "block_info");
+            m_tx_indices = lmdb::dbi::open(txn, "tx_indices");
+
+            if (!read_db_version(txn))
+            {
+                return false;
+            }
+
+            // from version 2, txs are split into txs_pruned,
+            // txs_prunable and txs_prunable_hash
+            m_pruned_layout = m_db_version >= 2;
+
+            if (m_pruned_layout)
+            {
+                m_txs_pruned        = lmdb::dbi::open(txn, "txs_pruned");
+                m_txs_prunable      = lmdb::dbi::open(txn, "txs_prunable");
+                m_txs_prunable_hash = lmdb::dbi::open(txn, "txs_prunable_hash");
+            }
+            else
+            {
+                m_txs = lmdb::dbi::open(txn, "txs");
+            }
+
+            lmdb::dbi_set_dupsort(txn, m_block_info.handle(), compare_uint64);
+            lmdb::dbi_set_dupsort(txn, m_tx_indices.handle(), compare_hash32);
+
+            txn.commit();
+
+            m_rtxn_pool.reset(new ReadTxnPool(m_env));
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Reads version of monerod's database from its properties,
+     * and checks that its layout is known. Databases without
+     * the version are of version 0.
+     */
+    bool
+    RawChainReader::read_db_version(lmdb::txn& txn)
+    {
+        // key is saved with its terminating null
+        const char version_key[] = "version";
+
+        try
+        {
+            lmdb::dbi properties = lmdb::dbi::open(txn, "properties");
+
+            lmdb::val key_val {version_key, sizeof(version_key)};
+            lmdb::val version_val;
+
+            if (properties.get(txn, key_val, version_val)
+                && version_val.size() == sizeof(m_db_version))
+            {
+                memcpy(&m_db_version, version_val.data(), sizeof(m_db_version));
+            }
+        }
+        catch (lmdb::not_found_error&)
+        {
+            // no properties at all
+        }
+
+        if (m_db_version < MIN_DB_VERSION || m_db_version > MAX_DB_VERSION)
+        {
+            cerr << "Unsupported version " << m_db_version
+                 << " of monerod's database. Only versions "
+                 << MIN_DB_VERSION << " to " << MAX_DB_VERSION
+                 << " can be read." << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::is_open() const
+    {
+        return m_open;
+    }
+
+
+    uint32_t
+    RawChainReader::db_version() const
+    {
+        return m_db_version;
+    }
+
+
+    /**
+     * Current height of the blockchain, i.e., number of blocks.
+     *
+     * Returns 0 on error.
+     */
+    uint64_t
+    RawChainReader::height()
+    {
+        if (!m_open)
+        {
+            return 0;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            return static_cast<uint64_t>(m_blocks.stat(snapshot.txn()).ms_entries);
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+        }
+
+        return 0;
+    }
+
+
+    bool
+    RawChainReader::top_block_hash(crypto::hash& blk_hash)
+    {
+        uint64_t blk_height = height();
+
+        return blk_height > 0 && get_block_hash(blk_height - 1, blk_hash);
+    }
+
+
+    bool
+    RawChainReader::get_block_blob(uint64_t blk_height, blobdata& blk_blob)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            lmdb::val blk_height_val {&blk_height, sizeof(blk_height)};
+            lmdb::val blk_blob_val;
+
+            if (!m_blocks.get(snapshot.txn(), blk_height_val, blk_blob_val))
+            {
+                return false;
+            }
+
+            blk_blob.assign(blk_blob_val.data(), blk_blob_val.size());
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::get_block(uint64_t blk_height, block& blk)
+    {
+        blobdata blk_blob;
+
+        if (!get_block_blob(blk_height, blk_blob))
+        {
+            return false;
+        }
+
+        if (!parse_and_validate_block_from_blob(blk_blob, blk))
+        {
+            cerr << "Cant parse block " << blk_height << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Hash of a block, as saved in block_info,
+     * so that the block does not have to be parsed.
+     */
+    bool
+    RawChainReader::get_block_hash(uint64_t blk_height, crypto::hash& blk_hash)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            lmdb::val info_val;
+
+            if (!get_block_info(snapshot.txn(), blk_height, info_val))
+            {
+                return false;
+            }
+
+            memcpy(&blk_hash,
+                   info_val.data() + block_hash_offset(m_db_version),
+                   sizeof(blk_hash));
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::get_block_timestamp(uint64_t blk_height, uint64_t& blk_timestamp)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            lmdb::val info_val;
+
+            if (!get_block_info(snapshot.txn(), blk_height, info_val))
+            {
+                return false;
+            }
+
+            memcpy(&blk_timestamp,
+                   info_val.data() + offsetof(mdb_block_info, bi_timestamp),
+                   sizeof(blk_timestamp));
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::get_tx_blob(const crypto::hash& tx_hash, blobdata& tx_blob)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            uint64_t tx_id;
+
+            if (!get_tx_id(snapshot.txn(), tx_hash, tx_id))
+            {
+                return false;
+            }
+
+            lmdb::val tx_id_val {&tx_id, sizeof(tx_id)};
+            lmdb::val tx_blob_val;
+
+            if (!m_pruned_layout)
+            {
+                if (!m_txs.get(snapshot.txn(), tx_id_val, tx_blob_val))
+                {
+                    return false;
+                }
+
+                tx_blob.assign(tx_blob_val.data(), tx_blob_val.size());
+
+                return true;
+            }
+
+            // whole blob is the pruned part followed by the prunable one
+            lmdb::val prunable_val;
+
+            if (!m_txs_pruned.get(snapshot.txn(), tx_id_val, tx_blob_val))
+            {
+                return false;
+            }
+
+            if (!m_txs_prunable.get(snapshot.txn(), tx_id_val, prunable_val))
+            {
+                cerr << "Prunable part of tx " << tx_hash
+                     << " is not in the database. Is the node pruned?" << endl;
+                return false;
+            }
+
+            tx_blob.reserve(tx_blob_val.size() + prunable_val.size());
+            tx_blob.assign(tx_blob_val.data(), tx_blob_val.size());
+            tx_blob.append(prunable_val.data(), prunable_val.size());
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::get_tx(const crypto::hash& tx_hash, transaction& tx)
+    {
+        blobdata tx_blob;
+
+        if (!get_tx_blob(tx_hash, tx_blob))
+        {
+            return false;
+        }
+
+        if (!parse_and_validate_tx_from_blob(tx_blob, tx))
+        {
+            cerr << "Cant parse tx " << tx_hash << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Tx with only its prefix and the base of its RingCT signatures
+     * parsed, as by parse_tx_prefix_from_blob. It is parsed straight
+     * from the database's memory map, without copying its blob, and
+     * from txs_pruned if the database has it, so that prunable
+     * parts of the tx are not even read.
+     */
+    bool
+    RawChainReader::get_tx_prefix(const crypto::hash& tx_hash, transaction& tx)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            uint64_t tx_id;
+            lmdb::val tx_blob_val;
+
+            if (!get_tx_id(snapshot.txn(), tx_hash, tx_id)
+                || !get_pruned_blob_val(snapshot.txn(), tx_id, tx_blob_val))
+            {
+                return false;
+            }
+
+            if (!parse_tx_prefix_from_blob(tx_blob_val.data(), tx_blob_val.size(), tx))
+            {
+                cerr << "Cant parse prefix of tx " << tx_hash << endl;
+                return false;
+            }
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Same as get_tx_prefix, but by tx's id, e.g., for txs of a block,
+     * which have consecutive ids after its miner tx. This saves
+     * lookups in tx_indices.
+     *
+     * Only for databases with txs_pruned, and RingCT txs, whose hash
+     * is calculated as in monero's calculate_transaction_hash, i.e.,
+     * hash of hashes of the prefix, of the base, and of the prunable
+     * part of the signatures, which is taken from txs_prunable_hash.
+     * So prunable parts are not read. Hash of older txs is the hash
+     * of their whole blob, which is not worth reading for this, so
+     * false is returned for them, as well as without txs_pruned.
+     */
+    bool
+    RawChainReader::get_tx_prefix(uint64_t tx_id,
+                                  transaction& tx,
+                                  crypto::hash& tx_hash)
+    {
+        if (!m_open || !m_pruned_layout)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            lmdb::val tx_blob_val;
+
+            if (!get_pruned_blob_val(snapshot.txn(), tx_id, tx_blob_val))
+            {
+                return false;
+            }
+
+            const char* data = tx_blob_val.data();
+            size_t size      = tx_blob_val.size();
+
+            // version is the first varint of
+            // the blob, so 1 is its first byte
+            if (size == 0 || data[0] == 1)
+            {
+                return false;
+            }
+
+            size_t prefix_size {0};
+            size_t base_size {0};
+
+            if (!parse_tx_prefix_from_blob(data, size, tx, &prefix_size, &base_size))
+            {
+                cerr << "Cant parse prefix of tx of id " << tx_id << endl;
+                return false;
+            }
+
+            crypto::hash hashes[3];
+
+            hashes[0] = cn_fast_hash(data, prefix_size);
+            hashes[1] = cn_fast_hash(data + prefix_size, base_size);
+
+            if (tx.rct_signatures.type == rct::RCTTypeNull)
+            {
+                hashes[2] = null_hash;
+            }
+            else if (!get_prunable_hash(snapshot.txn(), tx_id, hashes[2]))
+            {
+                return false;
+            }
+
+            tx_hash = cn_fast_hash(hashes, sizeof(hashes));
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool
+    RawChainReader::get_tx_id(const crypto::hash& tx_hash, uint64_t& tx_id)
+    {
+        if (!m_open)
+        {
+            return false;
+        }
+
+        try
+        {
+            read_txn_guard snapshot = m_rtxn_pool->snapshot();
+
+            return get_tx_id(snapshot.txn(), tx_hash, tx_id);
+        }
+        catch (lmdb::error& e)
+        {
+            cerr << e.what() << endl;
+        }
+
+        return false;
+    }
+
+
+    /**
+     * True if txs are in txs_pruned and txs_prunable,
+     * rather than in txs.
+     */
+    bool
+    RawChainReader::has_pruned_layout() const
+    {
+        return m_pruned_layout;
+    }
+
+
+    /**
+     * Frees the reader table slot of the calling thread,
+     * e.g., before the thread finishes.
+     */
+    void
+    RawChainReader::release_read_txn()
+    {
+        if (m_rtxn_pool)
+        {
+            m_rtxn_pool->release_this_thread();
+        }
+    }
+
+
+    bool
+    RawChainReader::get_block_info(lmdb::txn& rtxn,
+                                   uint64_t blk_height,
+                                   lmdb::val& info_val)
+    {
+        lmdb::cursor cr = lmdb::cursor::open(rtxn, m_block_info);
+
+        lmdb::val zero_key_val {&ZERO_KEY, sizeof(ZERO_KEY)};
+
+        // dups are compared by their first 8 bytes, i.e., bi_height
+        info_val = lmdb::val {&blk_height, sizeof(blk_height)};
+
+        bool found = cr.get(zero_key_val, info_val, MDB_GET_BOTH);
+
+        cr.close();
+
+        return found;
+    }
+
+
+    bool
+    RawChainReader::get_tx_id(lmdb::txn& rtxn,
+                              const crypto::hash& tx_hash,
+                              uint64_t& tx_id)
+    {
+        lmdb::cursor cr = lmdb::cursor::open(rtxn, m_tx_indices);
+
+        lmdb::val zero_key_val {&ZERO_KEY, sizeof(ZERO_KEY)};
+        lmdb::val tx_index_val {&tx_hash, sizeof(tx_hash)};
+
+        bool found = cr.get(zero_key_val, tx_index_val, MDB_GET_BOTH);
+
+        if (found)
+        {
+            memcpy(&tx_id,
+                   tx_index_val.data() + offsetof(mdb_txindex, tx_id),
+                   sizeof(tx_id));
+        }
+
+        cr.close();
+
+        return found;
+    }
+
+
+    /**
+     * Blob with at least the prefix and the base of RingCT
+     * signatures of a tx, i.e., from txs_pruned, or the whole
+     * blob from txs. It is valid only as long as rtxn is.
+     */
+    bool
+    RawChainReader::get_pruned_blob_val(lmdb::txn& rtxn,
+                                        uint64_t tx_id,
+                                        lmdb::val& tx_blob_val)
+    {
+        lmdb::val tx_id_val {&tx_id, sizeof(tx_id)};
+
+        if (m_pruned_layout)
+        {
+            return m_txs_pruned.get(rtxn, tx_id_val, tx_blob_val);
+        }
+
+        return m_txs.get(rtxn, tx_id_val, tx_blob_val);
+    }
+
+
+    bool
+    RawChainReader::get_prunable_hash(lmdb::txn& rtxn,
+                                      uint64_t tx_id,
+                                      crypto::hash& prunable_hash)
+    {
+        lmdb::val tx_id_val {&tx_id, sizeof(tx_id)};
+        lmdb::val hash_val;
+
+        if (!m_txs_prunable_hash.get(rtxn, tx_id_val, hash_val)
+            || hash_val.size() != sizeof(prunable_hash))
+        {
+            return false;
+        }
+
+        memcpy(&prunable_hash, hash_val.data(), sizeof(prunable_hash));
+
+        return true;
+    }
+
+}
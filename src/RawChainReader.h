@@ -0,0 +1,144 @@
+#ifndef XMRLMDBCPP_RAWCHAINREADER_H
+#define XMRLMDBCPP_RAWCHAINREADER_H
+
+#include "monero_headers.h"
+#include "ReadTxnPool.h"
+#include "tools.h"
+
+#include "../ext/lmdb++.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace xmreg
+{
+    using namespace cryptonote;
+    using namespace crypto;
+    using namespace std;
+
+    /**
+     * Reads blocks and txs directly from monerod's lmdb database,
+     * without BlockchainLMDB, HardFork and Blockchain, which
+     * take long to initialize, and which open the database
+     * with MDB_NOLOCK, i.e., without telling monerod which
+     * pages we are still reading.
+     *
+     * The database is opened read-only, with lmdb's locking,
+     * so our readers and monerod's writer never block each
+     * other, and pages we read are not reused under us. Each
+     * thread gets its own read txn from a ReadTxnPool.
+     *
+     * Blocks and txs are read from blocks, txs and tx_indices
+     * as blobs, and parsed only if needed. Their layout is as
+     * in monero's db_lmdb.cpp, which must be matched here.
+     *
+     * From version 2 of monerod's database, txs are split into
+     * txs_pruned, i.e., prefixes and bases of RingCT signatures,
+     * txs_prunable, i.e., the rest of the signatures, and
+     * txs_prunable_hash. Prefixes are then read only from txs_pruned.
+     * Versions whose layouts are not known here are refused.
+     *
+     * lmdb does not allow opening the same database twice in
+     * one process, so this is also what checks the blockchain's
+     * height and top block.
+     */
+    class RawChainReader
+    {
+        string m_blockchain_path;
+
+        lmdb::env m_env;
+
+        lmdb::dbi m_blocks;
+        lmdb::dbi m_block_info;
+        lmdb::dbi m_txs;
+        lmdb::dbi m_tx_indices;
+
+        // only if the database is split into pruned
+        // and prunable txs, in which case there is no txs
+        lmdb::dbi m_txs_pruned;
+        lmdb::dbi m_txs_prunable;
+        lmdb::dbi m_txs_prunable_hash;
+
+        bool m_pruned_layout;
+
+        // version of monerod's database, from its properties,
+        // which gives layout of values in block_info
+        uint32_t m_db_version;
+
+        unique_ptr<ReadTxnPool> m_rtxn_pool;
+
+        bool m_open;
+
+    public:
+        explicit RawChainReader(const string& _blockchain_path);
+
+        bool
+        is_open() const;
+
+        uint32_t
+        db_version() const;
+
+        uint64_t
+        height();
+
+        bool
+        top_block_hash(crypto::hash& blk_hash);
+
+        bool
+        get_block_blob(uint64_t blk_height, blobdata& blk_blob);
+
+        bool
+        get_block(uint64_t blk_height, block& blk);
+
+        bool
+        get_block_hash(uint64_t blk_height, crypto::hash& blk_hash);
+
+        bool
+        get_block_timestamp(uint64_t blk_height, uint64_t& blk_timestamp);
+
+        bool
+        get_tx_blob(const crypto::hash& tx_hash, blobdata& tx_blob);
+
+        bool
+        get_tx(const crypto::hash& tx_hash, transaction& tx);
+
+        bool
+        get_tx_prefix(const crypto::hash& tx_hash, transaction& tx);
+
+        bool
+        get_tx_prefix(uint64_t tx_id, transaction& tx, crypto::hash& tx_hash);
+
+        bool
+        get_tx_id(const crypto::hash& tx_hash, uint64_t& tx_id);
+
+        bool
+        has_pruned_layout() const;
+
+        void
+        release_read_txn();
+
+    private:
+
+        bool
+        open();
+
+        bool
+        read_db_version(lmdb::txn& txn);
+
+        bool
+        get_block_info(lmdb::txn& rtxn, uint64_t blk_height, lmdb::val& info_val);
+
+        bool
+        get_tx_id(lmdb::txn& rtxn, const crypto::hash& tx_hash, uint64_t& tx_id);
+
+        bool
+        get_pruned_blob_val(lmdb::txn& rtxn, uint64_t tx_id, lmdb::val& tx_blob_val);
+
+        bool
+        get_prunable_hash(lmdb::txn& rtxn, uint64_t tx_id, crypto::hash& prunable_hash);
+    };
+
+}
+
+#endif //XMRLMDBCPP_RAWCHAINREADER_H
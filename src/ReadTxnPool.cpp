@@ -0,0 +1,226 @@
+#include "ReadTxnPool.h"
+
+namespace xmreg
+{
+
+    ReadTxnPool::ReadTxnPool(MDB_env* _env)
+            : m_env {_env}
+    {}
+
+
+    /**
+     * Read-only snapshot of the database for the calling thread.
+     */
+    read_txn_guard
+    ReadTxnPool::snapshot()
+    {
+        return read_txn_guard(this, acquire());
+    }
+
+
+    /**
+     * Frees the reader table slot of the calling thread,
+     * e.g., before the thread finishes.
+     */
+    void
+    ReadTxnPool::release_this_thread()
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        auto it = m_slots.find(this_thread::get_id());
+
+        if (it != m_slots.end() && it->second->refs == 0)
+        {
+            m_slots.erase(it);
+        }
+    }
+
+
+    ReadTxnPool::~ReadTxnPool()
+    {
+        // transactions are aborted by their destructors
+        m_slots.clear();
+    }
+
+
+    ReadTxnPool::slot*
+    ReadTxnPool::acquire()
+    {
+        slot* s;
+
+        {
+            unique_lock<mutex> lock(m_mutex);
+
+            unique_ptr<slot>& s_ptr = m_slots[this_thread::get_id()];
+
+            if (!s_ptr)
+            {
+                s_ptr.reset(new slot());
+            }
+
+            s = s_ptr.get();
+
+            if (s->refs > 0)
+            {
+                // already in use higher up the call stack,
+                // so already counted as active
+                ++s->refs;
+                return s;
+            }
+
+            m_resize_cv.wait(lock, [this]() {return !m_resizing;});
+
+            ++m_active;
+        }
+
+        // slot is used only by its own thread,
+        // so no need to lock from now on
+
+        while (true)
+        {
+            try
+            {
+                if (!s->txn.handle())
+                {
+                    s->txn = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                }
+                else
+                {
+                    s->txn.renew();
+                }
+
+                break;
+            }
+            catch (lmdb::error& e)
+            {
+                if (e.code() != MDB_MAP_RESIZED)
+                {
+                    end_active();
+                    throw;
+                }
+
+                // other process has grown the database
+                adopt_new_mapsize();
+            }
+        }
+
+        s->refs = 1;
+
+        return s;
+    }
+
+
+    void
+    ReadTxnPool::release(slot* s)
+    {
+        if (--s->refs == 0)
+        {
+            s->txn.reset();
+
+            end_active();
+        }
+    }
+
+
+    /**
+     * Called by a thread without an active txn, after it got
+     * MDB_MAP_RESIZED. Returns once the new size is adopted,
+     * with the thread counted as active again.
+     */
+    void
+    ReadTxnPool::adopt_new_mapsize()
+    {
+        unique_lock<mutex> lock(m_mutex);
+
+        --m_active;
+
+        if (m_resizing)
+        {
+            // other thread is adopting it already
+            m_resize_cv.wait(lock, [this]() {return !m_resizing;});
+        }
+        else
+        {
+            m_resizing = true;
+
+            m_resize_cv.wait(lock, [this]() {return m_active == 0;});
+
+            try
+            {
+                lmdb::env_set_mapsize(m_env, 0);
+            }
+            catch (lmdb::error& e)
+            {
+                m_resizing = false;
+                m_resize_cv.notify_all();
+                throw;
+            }
+
+            m_resizing = false;
+            m_resize_cv.notify_all();
+        }
+
+        ++m_active;
+    }
+
+
+    void
+    ReadTxnPool::end_active()
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        if (--m_active == 0 && m_resizing)
+        {
+            m_resize_cv.notify_all();
+        }
+    }
+
+
+    read_txn_guard::read_txn_guard(ReadTxnPool* _pool, ReadTxnPool::slot* _slot)
+            : m_pool {_pool}, m_slot {_slot}
+    {}
+
+
+    read_txn_guard::read_txn_guard(read_txn_guard&& other)
+            : m_pool {other.m_pool}, m_slot {other.m_slot}
+    {
+        other.m_slot = nullptr;
+    }
+
+
+    read_txn_guard&
+    read_txn_guard::operator=(read_txn_guard&& other)
+    {
+        if (this != &other)
+        {
+            if (m_slot)
+            {
+                m_pool->release(m_slot);
+            }
+
+            m_pool = other.m_pool;
+            m_slot = other.m_slot;
+
+            other.m_slot = nullptr;
+        }
+
+        return *this;
+    }
+
+
+    lmdb::txn&
+    read_txn_guard::txn()
+    {
+        return m_slot->txn;
+    }
+
+
+    read_txn_guard::~read_txn_guard()
+    {
+        if (m_slot)
+        {
+            m_pool->release(m_slot);
+        }
+    }
+
+}
@@ -0,0 +1,119 @@
+#ifndef XMRLMDBCPP_READTXNPOOL_H
+#define XMRLMDBCPP_READTXNPOOL_H
+
+#include "../ext/lmdb++.h"
+
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace xmreg
+{
+    using namespace std;
+
+    class read_txn_guard;
+
+    /**
+     * Pool of read-only transactions, one per thread.
+     *
+     * Beginning a new read transaction for every query takes,
+     * and then releases, a slot in lmdb's reader table. Instead,
+     * each thread gets its own transaction which is reset when
+     * not in use, and renewed when the thread needs it again.
+     *
+     * Snapshots taken on the same thread, e.g., by a query
+     * calling other queries, share the same transaction.
+     *
+     * If other process, e.g., monerod, grows the database,
+     * beginning a txn fails with MDB_MAP_RESIZED, and the new
+     * size must be adopted with mdb_env_set_mapsize, which lmdb
+     * allows only when no txn in this process is active. So the
+     * thread which gets MDB_MAP_RESIZED first waits for all the
+     * active snapshots to finish, while new ones wait for it.
+     */
+    class ReadTxnPool
+    {
+        friend class read_txn_guard;
+
+        struct slot
+        {
+            lmdb::txn txn {nullptr};
+
+            // number of snapshots currently using the txn
+            size_t refs {0};
+        };
+
+        MDB_env* m_env;
+
+        mutex m_mutex;
+
+        map<thread::id, unique_ptr<slot>> m_slots;
+
+        // threads with an active txn, and whether some
+        // thread waits for them to adopt a new map size
+        size_t m_active {0};
+        bool   m_resizing {false};
+
+        condition_variable m_resize_cv;
+
+    public:
+        explicit ReadTxnPool(MDB_env* _env);
+
+        read_txn_guard
+        snapshot();
+
+        void
+        release_this_thread();
+
+        virtual ~ReadTxnPool();
+
+    private:
+
+        slot*
+        acquire();
+
+        void
+        release(slot* s);
+
+        void
+        adopt_new_mapsize();
+
+        void
+        end_active();
+    };
+
+
+    /**
+     * Read-only txn held by a caller for as long as
+     * it uses results obtained within it, e.g., views.
+     *
+     * Views point directly into lmdb's memory map, so
+     * they are valid only until the guard is destroyed.
+     */
+    class read_txn_guard
+    {
+        ReadTxnPool*       m_pool;
+        ReadTxnPool::slot* m_slot;
+
+    public:
+
+        read_txn_guard(ReadTxnPool* _pool, ReadTxnPool::slot* _slot);
+
+        read_txn_guard(read_txn_guard&& other);
+        read_txn_guard& operator=(read_txn_guard&& other);
+
+        read_txn_guard(const read_txn_guard&) = delete;
+        read_txn_guard& operator=(const read_txn_guard&) = delete;
+
+        lmdb::txn&
+        txn();
+
+        ~read_txn_guard();
+    };
+
+}
+
+#endif //XMRLMDBCPP_READTXNPOOL_H
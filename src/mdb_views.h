@@ -0,0 +1,230 @@
+#ifndef XMRLMDBCPP_MDB_VIEWS_H
+#define XMRLMDBCPP_MDB_VIEWS_H
+
+#include "../ext/lmdb++.h"
+
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+
+namespace xmreg
+{
+
+    /**
+     * Key and value of a dbi's entry, without copying them
+     * out of lmdb's memory map.
+     */
+    template <typename T>
+    struct mdb_view
+    {
+        const char* key_data {nullptr};
+        size_t      key_size {0};
+
+        const T*    value {nullptr};
+
+        uint64_t
+        key_as_uint64() const
+        {
+            return *reinterpret_cast<const uint64_t*>(key_data);
+        }
+
+        const T&
+        operator*() const
+        {
+            return *value;
+        }
+
+        const T*
+        operator->() const
+        {
+            return value;
+        }
+    };
+
+
+    /**
+     * Range of a dbi's entries to be used in range-for loops, e.g.,
+     *
+     *   for (const mdb_view<uint64_t>& v: mylmdb.search_view(guard, key))
+     *       cout << *v << endl;
+     *
+     * Holds one cursor, and yields views into the memory map,
+     * so nothing is allocated while iterating. Entries are
+     * either all values of a single key (dups_of), or all
+     * entries with integer keys in [start, end] (key_range).
+     */
+    template <typename T>
+    class mdb_range
+    {
+        // keys in our dbis are at most 32 bytes
+        static constexpr size_t MAX_KEY_SIZE = 64;
+
+        lmdb::cursor  m_cr;
+
+        // key to start from, kept here so that the range
+        // does not depend on caller's buffers
+        char          m_key_buf[MAX_KEY_SIZE];
+        size_t        m_key_size;
+
+        lmdb::val     m_key;
+        lmdb::val     m_val;
+
+        MDB_cursor_op m_first_op;
+        MDB_cursor_op m_next_op;
+
+        uint64_t      m_key_end;
+
+        bool          m_valid {false};
+
+        mdb_range(lmdb::txn& txn, lmdb::dbi& dbi,
+                  MDB_cursor_op first_op, MDB_cursor_op next_op)
+            : m_cr {lmdb::cursor::open(txn, dbi)},
+              m_key_size {0},
+              m_first_op {first_op}, m_next_op {next_op},
+              m_key_end {std::numeric_limits<uint64_t>::max()}
+        {}
+
+    public:
+
+        class iterator
+        {
+            mdb_range* m_range;
+
+        public:
+
+            explicit iterator(mdb_range* range = nullptr)
+                : m_range {range}
+            {}
+
+            mdb_view<T>
+            operator*() const
+            {
+                return m_range->current();
+            }
+
+            iterator&
+            operator++()
+            {
+                if (!m_range->next())
+                {
+                    m_range = nullptr;
+                }
+
+                return *this;
+            }
+
+            bool
+            operator!=(const iterator& other) const
+            {
+                return m_range != other.m_range;
+            }
+
+            bool
+            operator==(const iterator& other) const
+            {
+                return m_range == other.m_range;
+            }
+        };
+
+        /**
+         * All values of a given key in a DUPSORT dbi.
+         */
+        static mdb_range
+        dups_of(lmdb::txn& txn, lmdb::dbi& dbi,
+                const char* key_data, size_t key_size)
+        {
+            if (key_size > MAX_KEY_SIZE)
+            {
+                throw std::invalid_argument("mdb_range: key too long");
+            }
+
+            mdb_range range(txn, dbi, MDB_SET, MDB_NEXT_DUP);
+
+            std::memcpy(range.m_key_buf, key_data, key_size);
+            range.m_key_size = key_size;
+
+            return range;
+        }
+
+        /**
+         * All entries of an integer keyed dbi with
+         * keys in [key_start, key_end].
+         */
+        static mdb_range
+        key_range(lmdb::txn& txn, lmdb::dbi& dbi,
+                  uint64_t key_start, uint64_t key_end)
+        {
+            mdb_range range(txn, dbi, MDB_SET_RANGE, MDB_NEXT);
+
+            std::memcpy(range.m_key_buf, &key_start, sizeof(uint64_t));
+            range.m_key_size = sizeof(uint64_t);
+
+            range.m_key_end  = key_end;
+
+            return range;
+        }
+
+        mdb_range(mdb_range&& other) = default;
+
+        iterator
+        begin()
+        {
+            m_key = lmdb::val {m_key_buf, m_key_size};
+
+            m_valid = m_cr.get(m_key, m_val, m_first_op) && in_range();
+
+            return iterator {m_valid ? this : nullptr};
+        }
+
+        iterator
+        end()
+        {
+            return iterator {};
+        }
+
+        bool
+        empty()
+        {
+            return begin() == end();
+        }
+
+    private:
+
+        mdb_view<T>
+        current() const
+        {
+            mdb_view<T> view;
+
+            view.key_data = m_key.data();
+            view.key_size = m_key.size();
+            view.value    = m_val.data<T>();
+
+            return view;
+        }
+
+        bool
+        next()
+        {
+            m_valid = m_valid
+                      && m_cr.get(m_key, m_val, m_next_op)
+                      && in_range();
+
+            return m_valid;
+        }
+
+        bool
+        in_range() const
+        {
+            if (m_first_op != MDB_SET_RANGE)
+            {
+                return true;
+            }
+
+            return *m_key.data<uint64_t>() <= m_key_end;
+        }
+    };
+
+}
+
+#endif //XMRLMDBCPP_MDB_VIEWS_H
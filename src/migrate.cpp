@@ -0,0 +1,366 @@
+#include "migrate.h"
+
+namespace xmreg
+{
+
+    /**
+     * Height of the last block analyzed, as saved in last_height.txt
+     * by versions of the program before the meta dbi.
+     */
+    bool
+    read_last_height_file(const bf::path& db_path, uint64_t& last_height)
+    {
+        bf::path last_height_file {db_path / bf::path("last_height.txt")};
+
+        if (!bf::exists(last_height_file))
+        {
+            return false;
+        }
+
+        string last_height_str = xmreg::read(last_height_file.string());
+
+        boost::trim(last_height_str);
+
+        try
+        {
+            last_height = boost::lexical_cast<uint64_t>(last_height_str);
+        }
+        catch (boost::bad_lexical_cast& e)
+        {
+            cerr << "Incorrect " << last_height_file << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+
+    /**
+     * Fills in output_info_by_height with outputs of blocks
+     * from 0 up to, and including, last_height, which are already
+     * in the other dbis. Blocks are fetched again from the
+     * blockchain, as the other dbis dont have their heights.
+     */
+    static bool
+    index_outputs_by_height(MyLMDB& db,
+                            RawChainReader& chain,
+                            uint64_t last_height,
+                            size_t fetch_threads)
+    {
+        const uint64_t blocks_per_txn {1000};
+
+        // previous attempt could have been interrupted. Cleared
+        // in its own transaction, so that it is not lost if
+        // the first batch of blocks is written again.
+        if (!db.begin_txn()
+            || !db.clear_dbi(MyLMDB::D_output_info_by_height)
+            || !db.end_txn()
+            || !db.begin_txn())
+        {
+            return false;
+        }
+
+        BlockPipeline pipeline {chain, 0, last_height + 1,
+                                fetch_threads, 16 * fetch_threads};
+
+        // blocks written in the current write transaction, to be
+        // written again if the map gets full
+        vector<block_data> batch;
+
+        auto write_block = [&](const block_data& blk) -> bool
+        {
+            for (const tx_record& tx_rec: blk.tx_records)
+            {
+                if (!db.write_outputs_by_height(tx_rec))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        auto write_batch = [&]() -> bool
+        {
+            for (const block_data& blk: batch)
+            {
+                if (!write_block(blk))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        block_data blk_data;
+
+        while (pipeline.pop(blk_data))
+        {
+            if (!blk_data.error.empty())
+            {
+                cerr << "Cant get block " << blk_data.height
+                     << ": " << blk_data.error << endl;
+                db.abort_txn();
+                return false;
+            }
+
+            batch.push_back(std::move(blk_data));
+
+            if (!write_block(batch.back())
+                && !(db.map_full() && db.grow_map_and_replay(write_batch)))
+            {
+                db.abort_txn();
+                return false;
+            }
+
+            uint64_t blk_height = batch.back().height;
+
+            if ((blk_height + 1) % blocks_per_txn == 0)
+            {
+                cout << "Outputs indexed by height up to block "
+                     << blk_height << "/" << last_height << endl;
+
+                if (!db.end_txn(write_batch) || !db.begin_txn())
+                {
+                    return false;
+                }
+
+                batch.clear();
+            }
+        }
+
+        return db.end_txn(write_batch);
+    }
+
+
+    /**
+     * Fills in block_timestamps for blocks from 0 up to,
+     * and including, last_height.
+     */
+    static bool
+    index_block_timestamps(MyLMDB& db,
+                           RawChainReader& chain,
+                           uint64_t last_height)
+    {
+        const uint64_t blocks_per_txn {100000};
+
+        // cleared in its own transaction, as in index_outputs_by_height
+        if (!db.begin_txn()
+            || !db.clear_dbi(MyLMDB::D_block_timestamps)
+            || !db.end_txn()
+            || !db.begin_txn())
+        {
+            return false;
+        }
+
+        // timestamps written in the current write transaction,
+        // to be written again if the map gets full
+        uint64_t         batch_start {0};
+        vector<uint64_t> batch;
+
+        auto write_batch = [&]() -> bool
+        {
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                if (!db.write_block_timestamp(batch_start + i, batch[i]))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        for (uint64_t blk_height = 0; blk_height <= last_height; ++blk_height)
+        {
+            uint64_t blk_timestamp;
+
+            if (!chain.get_block_timestamp(blk_height, blk_timestamp))
+            {
+                cerr << "Cant get timestamp of block " << blk_height << endl;
+                db.abort_txn();
+                return false;
+            }
+
+            batch.push_back(blk_timestamp);
+
+            if (!db.write_block_timestamp(blk_height, blk_timestamp)
+                && !(db.map_full() && db.grow_map_and_replay(write_batch)))
+            {
+                db.abort_txn();
+                return false;
+            }
+
+            if ((blk_height + 1) % blocks_per_txn == 0)
+            {
+                if (!db.end_txn(write_batch) || !db.begin_txn())
+                {
+                    return false;
+                }
+
+                batch_start = blk_height + 1;
+                batch.clear();
+            }
+        }
+
+        return db.end_txn(write_batch);
+    }
+
+
+    /**
+     * Fills in dbis keyed by block heights, which were added
+     * after a given version, and marks the database as being
+     * in the current format.
+     */
+    static bool
+    fill_height_dbis(MyLMDB& db,
+                     RawChainReader& chain,
+                     uint64_t version,
+                     uint64_t last_height,
+                     size_t fetch_threads)
+    {
+        if (version < 3
+            && !index_outputs_by_height(db, chain,
+                                        last_height, fetch_threads))
+        {
+            return false;
+        }
+
+        if (version < 4
+            && !index_block_timestamps(db, chain, last_height))
+        {
+            return false;
+        }
+
+        return db.begin_txn() && db.write_schema_version() && db.end_txn();
+    }
+
+
+    /**
+     * Converts the custom database located in db_path
+     * into the current format, i.e., MyLMDB::SCHEMA_VERSION.
+     *
+     * The converted database is created next to the old one,
+     * and swapped with it once ready. The old database is
+     * kept in <db_path>_v<old version> folder, and can be
+     * removed afterwards.
+     *
+     * Databases in MyLMDB::MIN_IN_PLACE_VERSION or later only
+     * lack some dbis, so these are filled in place instead.
+     */
+    bool
+    migrate_custom_db(const bf::path& db_path,
+                      RawChainReader& chain,
+                      size_t fetch_threads)
+    {
+        uint64_t version;
+
+        {
+            MyLMDB old_db {db_path.string()};
+            version = old_db.schema_version();
+        }
+
+        if (version == MyLMDB::SCHEMA_VERSION)
+        {
+            cout << "Custom database " << db_path
+                 << " is already in the current format" << endl;
+            return true;
+        }
+
+        if (version > MyLMDB::SCHEMA_VERSION)
+        {
+            cerr << "Cant migrate custom database " << db_path
+                 << " from format version " << version << endl;
+            return false;
+        }
+
+        uint64_t last_height;
+        bool     has_blocks = read_last_height_file(db_path, last_height);
+
+        if (version >= MyLMDB::MIN_IN_PLACE_VERSION)
+        {
+            MyLMDB db {db_path.string()};
+
+            crypto::hash last_blk_hash;
+
+            if (db.get_checkpoint(last_height, last_blk_hash))
+            {
+                has_blocks = true;
+            }
+
+            if (!has_blocks)
+            {
+                // nothing to fill in
+                return db.begin_txn()
+                       && db.write_schema_version()
+                       && db.end_txn();
+            }
+
+            if (!fill_height_dbis(db, chain, version,
+                                  last_height, fetch_threads)
+                || !db.sync())
+            {
+                return false;
+            }
+
+            cout << "Custom database migrated in place" << endl;
+
+            return true;
+        }
+
+        bf::path new_path {db_path.string() + "_migrating"};
+        bf::path old_path {db_path.string() + "_v" + std::to_string(version)};
+
+        try
+        {
+            bf::remove_all(new_path);
+            bf::create_directory(new_path);
+
+            {
+                MyLMDB new_db {new_path.string()};
+
+                if (!new_db.import_old_db(db_path.string(), version))
+                {
+                    return false;
+                }
+
+                if (has_blocks
+                    && !fill_height_dbis(new_db, chain, version,
+                                         last_height, fetch_threads))
+                {
+                    return false;
+                }
+
+                if (!new_db.sync())
+                {
+                    return false;
+                }
+            }
+
+            // last analyzed height is not in the database,
+            // but in a text file next to it
+            bf::path last_height_file {db_path / bf::path("last_height.txt")};
+
+            if (bf::exists(last_height_file))
+            {
+                bf::copy_file(last_height_file,
+                              new_path / bf::path("last_height.txt"));
+            }
+
+            bf::rename(db_path, old_path);
+            bf::rename(new_path, db_path);
+        }
+        catch (bf::filesystem_error& e)
+        {
+            cerr << e.what() << endl;
+            return false;
+        }
+
+        cout << "Custom database migrated. The old one was moved to "
+             << old_path << " and can be removed." << endl;
+
+        return true;
+    }
+
+}
@@ -0,0 +1,23 @@
+#ifndef XMRLMDBCPP_MIGRATE_H
+#define XMRLMDBCPP_MIGRATE_H
+
+#include "mylmdb.h"
+#include "BlockPipeline.h"
+
+#include <boost/filesystem.hpp>
+
+namespace xmreg
+{
+    namespace bf = boost::filesystem;
+
+    bool
+    read_last_height_file(const bf::path& db_path, uint64_t& last_height);
+
+    bool
+    migrate_custom_db(const bf::path& db_path,
+                      RawChainReader& chain,
+                      size_t fetch_threads);
+
+}
+
+#endif //XMRLMDBCPP_MIGRATE_H
@@ -5,9 +5,22 @@
 #define XMRLMDBCPP_MYLMDB_H
 
 #include "../ext/lmdb++.h"
+#include "mdb_views.h"
+#include "ReadTxnPool.h"
+#include "BlockTimestamps.h"
+#include "KeyImageFilter.h"
+#include "KeyImageSnapshot.h"
+
+#include "tools.h"
 
 #include <iostream>
 #include <memory>
+#include <functional>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <tuple>
 
 namespace xmreg
 {
@@ -19,6 +32,25 @@ namespace xmreg
 
 
 
+    /**
+     * Size and usage of the memory map of a database.
+     */
+    struct map_stats
+    {
+        // current size of the map
+        uint64_t map_size;
+
+        // bytes up to the last page in use
+        uint64_t used;
+
+        uint64_t
+        headroom() const
+        {
+            return map_size > used ? map_size - used : 0;
+        }
+    };
+
+
     /**
      * Stores info about outputs useful
      * for checking which ouputs belong to a
@@ -33,7 +65,8 @@ namespace xmreg
         uint64_t           index_in_tx;
     };
 
-    std::ostream& operator<<(std::ostream& os, const output_info&  out_info)
+    inline std::ostream&
+    operator<<(std::ostream& os, const output_info&  out_info)
     {
         os  << ", out_pub_key: " << out_info.out_pub_key
             << ", tx_hash: " << out_info.tx_hash
@@ -44,6 +77,139 @@ namespace xmreg
         return os;
     }
 
+    /**
+     * Value of output_info_by_height. Dups of a height are sorted
+     * by comparing their bytes, so the output's index is stored
+     * big-endian in front, to keep them in the order of indices.
+     *
+     * Indices are global in the custom database, i.e., 0, 1, 2, ...
+     * for all outputs in the order they are in the blockchain.
+     * They are not monero's per-amount global output indices.
+     */
+    struct output_record
+    {
+        uint8_t     index_be[sizeof(uint64_t)];
+        output_info info;
+
+        output_record() = default;
+
+        output_record(uint64_t _index, const output_info& _info)
+            : info {_info}
+        {
+            for (size_t i = 0; i < sizeof(uint64_t); ++i)
+            {
+                index_be[i] = static_cast<uint8_t>(
+                        _index >> (8 * (sizeof(uint64_t) - 1 - i)));
+            }
+        }
+
+        uint64_t
+        index() const
+        {
+            uint64_t idx {0};
+
+            for (size_t i = 0; i < sizeof(uint64_t); ++i)
+            {
+                idx = (idx << 8) | index_be[i];
+            }
+
+            return idx;
+        }
+    };
+
+    /**
+     * All the information about a tx that goes into
+     * the custom databases, extracted from the tx
+     * only once, so that it does not have to be
+     * hashed or have its extra parsed for each of the dbis.
+     */
+    struct tx_record
+    {
+        crypto::hash              tx_hash;
+        crypto::public_key        tx_pub_key;
+        crypto::hash              payment_id;
+        crypto::hash8             payment_id8;
+        uint64_t                  blk_height;
+        uint64_t                  blk_timestamp;
+        vector<crypto::key_image> key_images;
+        vector<output_info>       outputs;
+    };
+
+    /**
+     * Extracts tx_record from a given tx.
+     *
+     * tx_hash is passed in, as it is usually already
+     * known, e.g., from the block's tx_hashes.
+     */
+    inline tx_record
+    make_tx_record(const transaction& tx,
+                   const crypto::hash& tx_hash,
+                   uint64_t blk_height,
+                   uint64_t blk_timestamp)
+    {
+        tx_record tx_rec;
+
+        tx_rec.tx_hash       = tx_hash;
+        tx_rec.blk_height    = blk_height;
+        tx_rec.tx_pub_key    = null_pkey;
+        tx_rec.payment_id    = null_hash;
+        tx_rec.payment_id8   = null_hash8;
+        tx_rec.blk_timestamp = blk_timestamp;
+
+        // parse tx extra only once, for both the tx public
+        // key and the payment ids
+        std::vector<tx_extra_field> tx_extra_fields;
+
+        bool extra_parsed = parse_tx_extra(tx.extra, tx_extra_fields);
+
+        tx_extra_pub_key pub_key_field;
+
+        if (find_tx_extra_field_by_type(tx_extra_fields, pub_key_field))
+        {
+            tx_rec.tx_pub_key = pub_key_field.pub_key;
+        }
+
+        tx_extra_nonce extra_nonce;
+
+        if (extra_parsed && find_tx_extra_field_by_type(tx_extra_fields, extra_nonce))
+        {
+            // first check for encrypted id and then for normal one
+            if (!get_encrypted_payment_id_from_tx_extra_nonce(extra_nonce.nonce,
+                                                              tx_rec.payment_id8))
+            {
+                get_payment_id_from_tx_extra_nonce(extra_nonce.nonce,
+                                                   tx_rec.payment_id);
+            }
+        }
+
+        for (const txin_v& in: tx.vin)
+        {
+            if (in.type() != typeid(txin_to_key))
+            {
+                continue;
+            }
+
+            tx_rec.key_images.push_back(boost::get<txin_to_key>(in).k_image);
+        }
+
+        for (uint64_t n = 0; n < tx.vout.size(); ++n)
+        {
+            if (tx.vout[n].target.type() != typeid(txout_to_key))
+            {
+                continue;
+            }
+
+            const txout_to_key& txout_key
+                    = boost::get<txout_to_key>(tx.vout[n].target);
+
+            tx_rec.outputs.push_back(output_info {txout_key.key, tx_hash,
+                                                  tx_rec.tx_pub_key,
+                                                  tx.vout[n].amount, n});
+        }
+
+        return tx_rec;
+    }
+
     static const char *DBI_NAMES[] = {
         "key_images",
         "output_public_keys",
@@ -51,17 +217,94 @@ namespace xmreg
         "output_info",
         "tx_public_keys",
         "payments_id",
-        "encrypted_payments_id"
+        "encrypted_payments_id",
+        "tx_ids",
+        "tx_hashes",
+        "output_info_by_height",
+        "block_timestamps",
+        "meta"
+    };
+
+    static const unsigned int DBI_FLAGS[] = {
+        MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP,
+        MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP,
+        MDB_DUPSORT | MDB_DUPFIXED,
+        MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED,
+        MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP,
+        MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP,
+        MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP,
+        MDB_INTEGERKEY,
+        0,
+        MDB_INTEGERKEY | MDB_DUPSORT | MDB_DUPFIXED,
+        MDB_INTEGERKEY,
+        0
+    };
+
+    // sizes of raw keys in each dbi. 0 for variable size keys.
+    static const size_t DBI_KEY_SIZES[] = {
+        sizeof(crypto::key_image),
+        sizeof(crypto::public_key),
+        sizeof(crypto::public_key),
+        sizeof(uint64_t),
+        sizeof(crypto::public_key),
+        sizeof(crypto::hash),
+        sizeof(crypto::hash8),
+        sizeof(uint64_t),
+        sizeof(crypto::hash),
+        sizeof(uint64_t),
+        sizeof(uint64_t),
+        0
+    };
+
+    // dbis whose keys are written mostly in increasing order,
+    // e.g., timestamps or ids. Puts into them use MDB_APPEND
+    // whenever the order allows for it.
+    static const bool DBI_APPEND[] = {
+        false,
+        false,
+        false,
+        true,
+        false,
+        false,
+        false,
+        true,
+        false,
+        true,
+        true,
+        false
     };
 
     class MyLMDB
     {
 
 
+        // initial size of the map. It is doubled whenever it gets full
         static const uint64_t DEFAULT_MAPSIZE = 30UL * 1024UL * 1024UL * 1024UL; /* 30 GiB */
-        static const uint64_t DEFAULT_NO_DBs  = 10;
+        static const uint64_t DEFAULT_NO_DBs  = 20;
+
+        // key image filter is built for twice as many key images as
+        // there are in the database, but for no fewer than these
+        static const uint64_t MIN_KEY_IMAGE_FILTER_CAPACITY = 1000000;
+
+        // new key images after which the filter is saved again
+        static const uint64_t KEY_IMAGE_FILTER_SAVE_INTERVAL = 100000;
 
     public:
+
+        // version of the format of the custom databases.
+        //  0 - keys and tx hashes stored as hex strings
+        //  1 - keys and tx hashes stored as raw bytes,
+        //      output_info keyed by integer timestamps
+        //  2 - tx hashes stored only in tx_ids and tx_hashes.
+        //      Other dbis store 64-bit tx ids
+        //  3 - outputs also in output_info_by_height
+        //  4 - timestamps of blocks in block_timestamps
+        static const uint64_t SCHEMA_VERSION  = 4;
+
+        // oldest version whose dbis can be opened as they are,
+        // i.e., which is upgraded by only adding new dbis
+        static const uint64_t MIN_IN_PLACE_VERSION = 2;
+
         enum D_dbi
         {
             D_key_images,
@@ -71,6 +314,11 @@ namespace xmreg
             D_tx_public_keys,
             D_payments_id,
             D_encrypted_payments_id,
+            D_tx_ids,
+            D_tx_hashes,
+            D_output_info_by_height,
+            D_block_timestamps,
+            D_meta,
             D_NUM_DBIS
         };
 
@@ -85,6 +333,56 @@ namespace xmreg
         lmdb::txn m_wtxn;
         lmdb::dbi *m_dbis;
 
+        // bytes of keys and values put in the current write transaction
+        uint64_t m_txn_size;
+
+        // format version of the opened database
+        uint64_t m_schema_version;
+
+        // id to be given to the next new tx. Ids are dense,
+        // i.e., 0, 1, 2, ... in the order txs are written
+        uint64_t m_next_tx_id;
+
+        // index to be given to the next output, also dense
+        uint64_t m_next_output_index;
+
+        // read-only txns reused by queries
+        unique_ptr<ReadTxnPool> m_rtxn_pool;
+
+        // last write failed because the map is full
+        bool m_map_full;
+
+        // largest key, and its largest value, in a dbi
+        // written with appends in the current write txn
+        struct append_state
+        {
+            bool   loaded {false};
+            bool   empty {true};
+            string key;
+            string val;
+        };
+
+        append_state m_append[D_NUM_DBIS];
+
+        // timestamps of blocks committed to block_timestamps,
+        // loaded from the database when queried
+        BlockTimestamps m_blk_timestamps;
+        mutex           m_blk_timestamps_mutex;
+
+        // optional filter of key images, checked before
+        // searching key_images. nullptr if not enabled.
+        unique_ptr<KeyImageFilter> m_key_image_filter;
+
+        // rate the filter is built for, already clamped
+        double m_key_image_filter_fp_rate;
+
+        // key images in the database when the filter was last saved
+        uint64_t m_key_image_filter_saved_keys;
+
+        // optional snapshot of key images up to some height,
+        // searched before key_images. nullptr if not enabled.
+        unique_ptr<KeyImageSnapshot> m_key_image_snapshot;
+
 
     public:
         MyLMDB(string _path,
@@ -93,11 +391,25 @@ namespace xmreg
                 : m_db_path {_path},
                   m_mapsize {_mapsize},
                   m_no_dbs {_no_dbs},
-                  m_env {nullptr}, m_wtxn {nullptr}
+                  m_env {nullptr}, m_wtxn {nullptr},
+                  m_txn_size {0},
+                  m_schema_version {SCHEMA_VERSION},
+                  m_next_tx_id {0},
+                  m_next_output_index {0},
+                  m_map_full {false},
+                  m_key_image_filter_fp_rate {0},
+                  m_key_image_filter_saved_keys {0}
         {
             create_and_open_env();
         }
 
+        virtual ~MyLMDB()
+        {
+            // key images since the last save would
+            // otherwise make it be built again
+            save_key_image_filter();
+        }
+
         bool
         create_and_open_env()
         {
@@ -105,12 +417,49 @@ namespace xmreg
             {   m_env = lmdb::env::create();
                 m_env.set_mapsize(m_mapsize);
                 m_env.set_max_dbs(m_no_dbs);
-                m_env.open(m_db_path.c_str(), MDB_CREATE|MDB_NOSYNC, 0664);
+                // MDB_NOTLS ties reader slots to txns rather than
+                // threads, as pooled txns outlive their queries
+                m_env.open(m_db_path.c_str(), MDB_CREATE|MDB_NOSYNC|MDB_NOTLS, 0664);
+                m_rtxn_pool.reset(new ReadTxnPool(m_env));
                 m_wtxn = lmdb::txn::begin(m_env);
                 m_dbis = static_cast<lmdb::dbi *>(::operator new[](D_NUM_DBIS * sizeof(lmdb::dbi)));
-                unsigned int i, flags = MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED;
-                for (i=D_key_images; i<D_NUM_DBIS; i++)
-                    m_dbis[i] = lmdb::dbi::open(m_wtxn, DBI_NAMES[i], flags);
+
+                if (!has_dbi(m_wtxn, DBI_NAMES[D_meta])
+                    && has_dbi(m_wtxn, DBI_NAMES[D_key_images]))
+                {
+                    // database created before versions were
+                    // introduced, i.e., with hex strings
+                    m_schema_version = 0;
+                }
+                else
+                {
+                    m_dbis[D_meta] = lmdb::dbi::open(m_wtxn, DBI_NAMES[D_meta],
+                                                     MDB_CREATE);
+
+                    if (!m_dbis[D_meta].get(m_wtxn, "version", m_schema_version))
+                    {
+                        // new database
+                        m_schema_version = SCHEMA_VERSION;
+                        m_dbis[D_meta].put(m_wtxn, "version", m_schema_version);
+                    }
+                }
+
+                if (m_schema_version < MIN_IN_PLACE_VERSION
+                    || m_schema_version > SCHEMA_VERSION)
+                {
+                    // the database needs to be imported into
+                    // a new one first, so dont touch its dbis
+                    m_wtxn.abort();
+                    return false;
+                }
+
+                // dbis missing in older versions are created
+                // here, but are empty until the database
+                // is migrated
+
+                for (unsigned int i = D_key_images; i < D_meta; i++)
+                    m_dbis[i] = lmdb::dbi::open(m_wtxn, DBI_NAMES[i],
+                                                MDB_CREATE | DBI_FLAGS[i]);
                 m_wtxn.commit();
             }
             catch (lmdb::error& e )
@@ -122,6 +471,17 @@ namespace xmreg
             return true;
         }
 
+        /**
+         * Format version of the opened database. If it is
+         * different than SCHEMA_VERSION, the database
+         * must be migrated before it can be used.
+         */
+        uint64_t
+        schema_version() const
+        {
+            return m_schema_version;
+        }
+
         bool
         sync()
         {
@@ -142,6 +502,15 @@ namespace xmreg
         {
             try
             {   m_wtxn = lmdb::txn::begin(m_env);
+                m_txn_size = 0;
+                m_map_full = false;
+
+                for (append_state& last: m_append)
+                {
+                    last.loaded = false;
+                }
+                m_next_tx_id = m_dbis[D_tx_ids].size(m_wtxn);
+                m_next_output_index = m_dbis[D_output_info_by_height].size(m_wtxn);
             }
             catch (lmdb::error& e )
             {
@@ -159,102 +528,1268 @@ namespace xmreg
             {   m_wtxn.commit();
             }
             catch (lmdb::error& e )
+            {
+                cerr << e.what() << endl;
+                m_map_full = e.code() == MDB_MAP_FULL;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Discards everything written in the current write transaction.
+         */
+        void
+        abort_txn()
+        {
+            if (m_wtxn.handle())
+            {
+                m_wtxn.abort();
+            }
+        }
+
+        /**
+         * True if the last write or commit failed because
+         * the map is full. The write transaction must be then
+         * aborted, the map grown with grow_map(), and the writes
+         * repeated in a new transaction.
+         */
+        bool
+        map_full() const
+        {
+            return m_map_full;
+        }
+
+        /**
+         * Doubles the size of the memory map.
+         *
+         * Can be called only if there are no active transactions
+         * in this process, i.e., after the write transaction is
+         * committed or aborted, and outside of any queries.
+         */
+        bool
+        grow_map()
+        {
+            try
+            {
+                MDB_envinfo info;
+                lmdb::env_info(m_env, &info);
+
+                uint64_t new_mapsize = 2 * static_cast<uint64_t>(info.me_mapsize);
+
+                m_env.set_mapsize(new_mapsize);
+
+                m_mapsize  = new_mapsize;
+                m_map_full = false;
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Called when the current write transaction failed
+         * as the map is full, which loses everything written in it.
+         * So the transaction is aborted, the map grown, and
+         * the writes repeated with write_batch in a new transaction,
+         * until they fit.
+         *
+         * The new transaction is left open for the caller to
+         * continue writing into, and to commit.
+         */
+        bool
+        grow_map_and_replay(const std::function<bool()>& write_batch)
+        {
+            while (true)
+            {
+                abort_txn();
+
+                if (!grow_map() || !begin_txn())
+                {
+                    return false;
+                }
+
+                map_stats stats;
+
+                if (get_map_stats(stats))
+                {
+                    cout << "Custom database map grown to "
+                         << stats.map_size / (1024 * 1024) << " MiB" << endl;
+                }
+
+                if (write_batch())
+                {
+                    return true;
+                }
+
+                if (!map_full())
+                {
+                    // failed for some other reason
+                    return false;
+                }
+            }
+        }
+
+        /**
+         * Commits the current write transaction. If it does not
+         * fit into the map, its writes are repeated with write_batch,
+         * as in grow_map_and_replay, and committed again.
+         */
+        bool
+        end_txn(const std::function<bool()>& write_batch)
+        {
+            while (!end_txn())
+            {
+                if (!map_full() || !grow_map_and_replay(write_batch))
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /**
+         * Size of the memory map, and how much of it is used.
+         */
+        bool
+        get_map_stats(map_stats& stats)
+        {
+            try
+            {
+                MDB_envinfo info;
+                MDB_stat    stat;
+
+                lmdb::env_info(m_env, &info);
+                lmdb::env_stat(m_env, &stat);
+
+                stats.map_size = info.me_mapsize;
+                stats.used     = (info.me_last_pgno + 1) * stat.ms_psize;
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Returns approximate number of bytes (keys and values)
+         * written so far in the current write transaction.
+         */
+        uint64_t
+        txn_size() const
+        {
+            return m_txn_size;
+        }
+
+        /**
+         * Enables filter of key images, which answers most searches
+         * for key images not in the database, i.e., of unspent
+         * outputs, without searching key_images.
+         *
+         * The filter is loaded from its snapshot in the database's
+         * folder. If there is none, or it is out of date, e.g., other
+         * key images were written since, it is built again from
+         * all key images in the database, and saved.
+         *
+         * Must be called before any searches or writes are made.
+         */
+        bool
+        enable_key_image_filter(double fp_rate)
+        {
+            m_key_image_filter_fp_rate = KeyImageFilter::clamp_fp_rate(fp_rate);
+
+            uint64_t no_keys {0};
+
+            try
+            {
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                no_keys = m_dbis[D_key_images].size(rtxn);
+
+                uint64_t saved_keys {0};
+
+                unique_ptr<KeyImageFilter> filter
+                        = KeyImageFilter::load(key_image_filter_path(), saved_keys);
+
+                if (filter
+                    && saved_keys == no_keys
+                    && filter->fp_rate() == m_key_image_filter_fp_rate
+                    && no_keys <= filter->capacity())
+                {
+                    m_key_image_filter = std::move(filter);
+                    m_key_image_filter_saved_keys = saved_keys;
+                    return true;
+                }
+
+                build_key_image_filter(rtxn, no_keys);
+            }
+            catch (lmdb::error& e)
             {
                 cerr << e.what() << endl;
                 return false;
             }
 
+            // filter is usable even if it could not be saved
+            if (m_key_image_filter->save(key_image_filter_path(), no_keys))
+            {
+                m_key_image_filter_saved_keys = no_keys;
+            }
+
             return true;
         }
 
+        /**
+         * Keeps the key image filter up to date after a commit. It is
+         * built again, for twice as many key images, once key_images
+         * holds more than its capacity, so its false positive rate
+         * does not grow. It is saved after every
+         * KEY_IMAGE_FILTER_SAVE_INTERVAL new key images, rather than
+         * after every commit, as it can take hundreds of MB.
+         *
+         * Must be called from the thread writing txs, outside of
+         * a write txn, and not while searches are made.
+         */
         bool
-        write_key_images(const transaction& tx)
+        update_key_image_filter()
         {
-            crypto::hash tx_hash = get_transaction_hash(tx);
+            if (!m_key_image_filter)
+            {
+                return true;
+            }
 
-            string tx_hash_str = pod_to_hex(tx_hash);
+            uint64_t no_keys {0};
 
-            vector<cryptonote::txin_to_key> key_images
-                    = xmreg::get_key_images(tx);
+            bool rebuilt {false};
 
-            for (const cryptonote::txin_to_key& key_image: key_images)
+            try
             {
-                string key_img_str = pod_to_hex(key_image.k_image);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
-                lmdb::val key_img_val {key_img_str};
-                lmdb::val tx_hash_val {tx_hash_str};
+                no_keys = m_dbis[D_key_images].size(rtxn);
 
-                m_dbis[D_key_images].put(m_wtxn, key_img_val, tx_hash_val);
+                // committed key images only, as write_tx runs again
+                // for the same txs when a batch is replayed
+                if (no_keys > m_key_image_filter->capacity())
+                {
+                    build_key_image_filter(rtxn, no_keys);
+                    rebuilt = true;
+                }
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
             }
+
+            if (!rebuilt
+                && no_keys < m_key_image_filter_saved_keys + KEY_IMAGE_FILTER_SAVE_INTERVAL)
+            {
+                return true;
+            }
+
+            return save_key_image_filter();
+        }
+
+        /**
+         * Saves snapshot of the key image filter, if key images
+         * were committed since it was last saved. Must be called
+         * from the thread writing txs, outside of write_tx.
+         */
+        bool
+        save_key_image_filter()
+        {
+            if (!m_key_image_filter)
+            {
+                return true;
+            }
+
+            uint64_t no_keys {0};
+
+            try
+            {
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                no_keys = m_dbis[D_key_images].size(rtxn);
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            if (no_keys == m_key_image_filter_saved_keys)
+            {
+                return true;
+            }
+
+            // key images of an open write txn can already be in the
+            // filter. That is fine, as they are only extra positives.
+            if (!m_key_image_filter->save(key_image_filter_path(), no_keys))
+            {
+                return false;
+            }
+
+            m_key_image_filter_saved_keys = no_keys;
+
+            return true;
+        }
+
+        /**
+         * False if a key image, as raw bytes, is surely not
+         * in key_images. Always true if the filter is not enabled.
+         */
+        bool
+        might_have_key_image(const void* key_image) const
+        {
+            return !m_key_image_filter
+                   || m_key_image_filter->might_contain(key_image);
+        }
+
+        /**
+         * Saves snapshot of key images of blocks up to a given
+         * height into the database's folder, to be used by
+         * enable_key_image_snapshot. The height must be
+         * already written into the database.
+         */
+        bool
+        build_key_image_snapshot(uint64_t blk_height)
+        {
+            uint64_t     last_height;
+            crypto::hash last_blk_hash;
+
+            if (!get_checkpoint(last_height, last_blk_hash) || blk_height > last_height)
+            {
+                cerr << "Block " << blk_height << " is not in the database yet" << endl;
+                return false;
+            }
+
+            vector<KeyImageSnapshot::entry> entries;
+
+            // one more than the highest id of txs in the blocks
+            uint64_t tx_id_limit {0};
+
+            crypto::hash last_tx_hash = null_hash;
+
+            try
+            {
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                // txs of blocks up to the height. Tx ids cant be
+                // compared with a cutoff, as in databases imported
+                // from older formats they dont follow the blockchain.
+                // Every tx has outputs, so its id is found through
+                // output_info_by_height.
+                vector<bool> in_blocks(m_dbis[D_tx_ids].size(rtxn), false);
+
+                lmdb::cursor out_cr = lmdb::cursor::open(rtxn,
+                                                         m_dbis[D_output_info_by_height]);
+
+                lmdb::val height_val;
+                lmdb::val out_rec_val;
+
+                crypto::hash prev_tx_hash = null_hash;
+
+                MDB_cursor_op op = MDB_FIRST;
+
+                while (out_cr.get(height_val, out_rec_val, op))
+                {
+                    op = MDB_NEXT;
+
+                    uint64_t out_height;
+
+                    memcpy(&out_height, height_val.data(), sizeof(out_height));
+
+                    if (out_height > blk_height)
+                    {
+                        break;
+                    }
+
+                    output_record out_rec;
+
+                    memcpy(&out_rec, out_rec_val.data(), sizeof(out_rec));
+
+                    // outputs of a tx are next to each other
+                    if (out_rec.info.tx_hash == prev_tx_hash)
+                    {
+                        continue;
+                    }
+
+                    prev_tx_hash = out_rec.info.tx_hash;
+
+                    uint64_t tx_id;
+
+                    if (!m_dbis[D_tx_hashes].get(rtxn, out_rec.info.tx_hash, tx_id)
+                        || tx_id >= in_blocks.size())
+                    {
+                        cerr << "Cant find tx id of outputs in block "
+                             << out_height << endl;
+                        return false;
+                    }
+
+                    in_blocks[tx_id] = true;
+                    tx_id_limit      = std::max(tx_id_limit, tx_id + 1);
+                }
+
+                out_cr.close();
+
+                if (tx_id_limit == 0)
+                {
+                    cerr << "No outputs up to block " << blk_height
+                         << " in output_info_by_height" << endl;
+                    return false;
+                }
+
+                // identifies the database the snapshot is of
+                if (!m_dbis[D_tx_ids].get(rtxn, tx_id_limit - 1, last_tx_hash))
+                {
+                    cerr << "Cant find tx of id " << tx_id_limit - 1 << endl;
+                    return false;
+                }
+
+                entries.reserve(m_dbis[D_key_images].size(rtxn));
+
+                lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[D_key_images]);
+
+                lmdb::val key_image_val;
+                lmdb::val tx_id_val;
+                lmdb::val other_tx_id_val;
+
+                while (cr.get(key_image_val, tx_id_val, MDB_NEXT_NODUP))
+                {
+                    // snapshot holds one tx id per key image, so those
+                    // with more of them are left to key_images
+                    if (cr.get(key_image_val, other_tx_id_val, MDB_NEXT_DUP))
+                    {
+                        continue;
+                    }
+
+                    uint64_t tx_id;
+
+                    memcpy(&tx_id, tx_id_val.data(), sizeof(tx_id));
+
+                    if (tx_id >= in_blocks.size()
+                        || !in_blocks[tx_id]
+                        || key_image_val.size() != KeyImageSnapshot::KEY_SIZE)
+                    {
+                        continue;
+                    }
+
+                    entries.emplace_back();
+
+                    memcpy(entries.back().key_image, key_image_val.data(),
+                           KeyImageSnapshot::KEY_SIZE);
+
+                    entries.back().tx_id = tx_id;
+                }
+
+                cr.close();
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            unique_ptr<KeyImageSnapshot> key_image_snapshot
+                    = KeyImageSnapshot::build(entries, blk_height,
+                                              tx_id_limit, &last_tx_hash);
+
+            return key_image_snapshot
+                   && key_image_snapshot->save(key_image_snapshot_path());
+        }
+
+        /**
+         * Loads snapshot of key images saved by build_key_image_snapshot.
+         * Key images found in it are not searched in key_images. The
+         * others, i.e., of later blocks or not spent, still are.
+         *
+         * Must be called before any searches are made.
+         */
+        bool
+        enable_key_image_snapshot()
+        {
+            unique_ptr<KeyImageSnapshot> key_image_snapshot
+                    = KeyImageSnapshot::load(key_image_snapshot_path());
+
+            if (!key_image_snapshot)
+            {
+                cerr << "No snapshot of key images in "
+                     << key_image_snapshot_path() << endl;
+                return false;
+            }
+
+            try
+            {
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                uint64_t tx_id_limit = key_image_snapshot->tx_id_limit();
+
+                if (tx_id_limit > m_dbis[D_tx_ids].size(rtxn))
+                {
+                    cerr << "Snapshot of key images is newer than the database" << endl;
+                    return false;
+                }
+
+                // e.g., database built again since, with
+                // at least as many txs, but different ids
+                crypto::hash last_tx_hash = null_hash;
+
+                if (tx_id_limit > 0
+                    && !m_dbis[D_tx_ids].get(rtxn, tx_id_limit - 1, last_tx_hash))
+                {
+                    return false;
+                }
+
+                if (memcmp(&last_tx_hash, key_image_snapshot->last_tx_hash(),
+                           sizeof(last_tx_hash)) != 0)
+                {
+                    cerr << "Snapshot of key images is not of this database. "
+                         << "Build it again." << endl;
+                    return false;
+                }
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            m_key_image_snapshot = std::move(key_image_snapshot);
+
+            return true;
+        }
+
+        /**
+         * Writes all the information about a tx
+         * into the custom databases. All tx's fields
+         * are extracted beforehand, in make_tx_record.
+         */
+        bool
+        write_tx(const tx_record& tx_rec)
+        {
+            try
+            {
+                uint64_t tx_id = get_or_add_tx_id(tx_rec.tx_hash);
+
+                lmdb::val tx_id_val {&tx_id, sizeof(tx_id)};
+
+                for (const crypto::key_image& key_image: tx_rec.key_images)
+                {
+                    lmdb::val key_img_val {&key_image, sizeof(key_image)};
+
+                    put(D_key_images, key_img_val, tx_id_val);
+
+                    // if the txn is aborted, the filter keeps the key
+                    // image. It only makes it a false positive.
+                    if (m_key_image_filter)
+                    {
+                        m_key_image_filter->insert(&key_image);
+                    }
+                }
+
+                uint64_t out_timestamp = tx_rec.blk_timestamp;
+
+                lmdb::val out_timestamp_val {static_cast<void*>(&out_timestamp),
+                                             sizeof(out_timestamp)};
+
+                for (const output_info& out_info: tx_rec.outputs)
+                {
+                    lmdb::val public_key_val {&out_info.out_pub_key,
+                                              sizeof(out_info.out_pub_key)};
+
+                    uint64_t amount = out_info.amount;
+
+                    lmdb::val amount_val   {static_cast<void*>(&amount), sizeof(amount)};
+                    lmdb::val out_info_val {static_cast<const void*>(&out_info),
+                                            sizeof(out_info)};
+
+                    put(D_output_public_keys, public_key_val, tx_id_val);
+                    put(D_output_amounts, public_key_val, amount_val);
+                    put(D_output_info, out_timestamp_val, out_info_val);
+                }
+
+                put_outputs_by_height(tx_rec);
+
+                lmdb::val public_key_val {&tx_rec.tx_pub_key, sizeof(tx_rec.tx_pub_key)};
+
+                put(D_tx_public_keys, public_key_val, tx_id_val);
+
+                if (tx_rec.payment_id != null_hash)
+                {
+                    lmdb::val payment_id_val {&tx_rec.payment_id,
+                                              sizeof(tx_rec.payment_id)};
+
+                    put(D_payments_id, payment_id_val, tx_id_val);
+                }
+
+                if (tx_rec.payment_id8 != null_hash8)
+                {
+                    lmdb::val payment_id_val {&tx_rec.payment_id8,
+                                              sizeof(tx_rec.payment_id8)};
+
+                    put(D_encrypted_payments_id, payment_id_val, tx_id_val);
+                }
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                m_map_full = e.code() == MDB_MAP_FULL;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Saves timestamp of a block, in the current write transaction.
+         */
+        bool
+        write_block_timestamp(uint64_t blk_height, uint64_t blk_timestamp)
+        {
+            try
+            {
+                lmdb::val blk_height_val    {&blk_height, sizeof(blk_height)};
+                lmdb::val blk_timestamp_val {&blk_timestamp, sizeof(blk_timestamp)};
+
+                put(D_block_timestamps, blk_height_val, blk_timestamp_val);
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                m_map_full = e.code() == MDB_MAP_FULL;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Writes only tx's outputs into output_info_by_height,
+         * e.g., when filling it in for an older database.
+         */
+        bool
+        write_outputs_by_height(const tx_record& tx_rec)
+        {
+            try
+            {
+                put_outputs_by_height(tx_rec);
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                m_map_full = e.code() == MDB_MAP_FULL;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Removes all entries of a given dbi
+         * in the current write transaction.
+         */
+        bool
+        clear_dbi(const enum D_dbi wdbi)
+        {
+            try
+            {
+                m_dbis[wdbi].drop(m_wtxn, false);
+
+                if (wdbi == D_output_info_by_height)
+                {
+                    m_next_output_index = 0;
+                }
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Marks the database as being in the current format,
+         * once it has been migrated in place.
+         */
+        bool
+        write_schema_version()
+        {
+            try
+            {
+                m_schema_version = SCHEMA_VERSION;
+                m_dbis[D_meta].put(m_wtxn, "version", m_schema_version);
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Saves height and hash of the last block written
+         * in the current write transaction, so that they are
+         * committed together with the block's data.
+         */
+        bool
+        write_checkpoint(uint64_t blk_height, const crypto::hash& blk_hash)
+        {
+            try
+            {
+                m_dbis[D_meta].put(m_wtxn, "height", blk_height);
+                m_dbis[D_meta].put(m_wtxn, "block_hash", blk_hash);
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                m_map_full = e.code() == MDB_MAP_FULL;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Returns height and hash of the last block written.
+         *
+         * Returns false if no block was written yet.
+         */
+        bool
+        get_checkpoint(uint64_t& blk_height, crypto::hash& blk_hash)
+        {
+            try
+            {
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                if (!m_dbis[D_meta].get(rtxn, "height", blk_height))
+                {
+                    return false;
+                }
+
+                if (!m_dbis[D_meta].get(rtxn, "block_hash", blk_hash))
+                {
+                    blk_hash = null_hash;
+                }
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Returns id of a given tx. If the tx is not yet
+         * in tx_ids, it is given the next free id.
+         *
+         * Must be called within a write transaction.
+         */
+        uint64_t
+        get_or_add_tx_id(const crypto::hash& tx_hash)
+        {
+            lmdb::val tx_hash_val {&tx_hash, sizeof(tx_hash)};
+            lmdb::val tx_id_val;
+
+            if (m_dbis[D_tx_hashes].get(m_wtxn, tx_hash_val, tx_id_val))
+            {
+                return *(tx_id_val.data<uint64_t>());
+            }
+
+            uint64_t tx_id = m_next_tx_id++;
+
+            lmdb::val new_tx_id_val {&tx_id, sizeof(tx_id)};
+
+            put(D_tx_ids, new_tx_id_val, tx_hash_val);
+            put(D_tx_hashes, tx_hash_val, new_tx_id_val);
+
+            return tx_id;
+        }
+
+        /**
+         * Copies all the data from a database in one of the older
+         * formats, i.e., version 0 (hex strings) or 1 (raw bytes,
+         * with tx hashes as values), located in old_path,
+         * into this database.
+         *
+         * Data is committed in batches of entries_per_txn. If a batch
+         * does not fit into the map, the map is grown, and the batch
+         * read from the old database and written again.
+         *
+         * Tx ids are given in the order the old dbis are read, which
+         * is not the order of the blockchain. In version 0, keys of
+         * output_info are little-endian timestamps without
+         * MDB_INTEGERKEY, so even they are not read in time order.
+         * So ids in imported databases must not be assumed to
+         * follow the blockchain.
+         */
+        bool
+        import_old_db(const string& old_path,
+                      uint64_t old_version,
+                      uint64_t entries_per_txn = 1000000)
+        {
+            if (old_version > 1)
+            {
+                cerr << "Cant import database of version " << old_version << endl;
+                return false;
+            }
+
+            static const D_dbi dbis_to_import[] = {
+                D_output_info,
+                D_key_images,
+                D_output_public_keys,
+                D_output_amounts,
+                D_tx_public_keys,
+                D_payments_id,
+                D_encrypted_payments_id
+            };
+
+            try
+            {
+                lmdb::env old_env = lmdb::env::create();
+                old_env.set_max_dbs(m_no_dbs);
+                old_env.open(old_path.c_str(), MDB_RDONLY, 0664);
+
+                lmdb::txn rtxn = lmdb::txn::begin(old_env, nullptr, MDB_RDONLY);
+
+                for (const D_dbi wdbi: dbis_to_import)
+                {
+                    cout << "Migrating " << DBI_NAMES[wdbi] << endl;
+
+                    lmdb::dbi old_dbi = lmdb::dbi::open(rtxn, DBI_NAMES[wdbi], 0);
+                    lmdb::cursor cr   = lmdb::cursor::open(rtxn, old_dbi);
+
+                    lmdb::val key;
+                    lmdb::val val;
+
+                    uint64_t no_entries {0};
+
+                    // writes an entry of the old dbi into
+                    // the current write transaction
+                    auto import_entry = [&]() -> bool
+                    {
+                        string key_str (key.data(), key.size());
+                        string val_str (val.data(), val.size());
+
+                        // output_info always had binary keys and
+                        // values. In others, in version 0, keys
+                        // are hex strings.
+                        if (wdbi != D_output_info)
+                        {
+                            string key_bin;
+
+                            if (!to_binary_key(key_str, wdbi, key_bin))
+                            {
+                                cerr << "Cant convert key: " << key_str
+                                     << " in " << DBI_NAMES[wdbi] << endl;
+                                return false;
+                            }
+
+                            key_str = key_bin;
+                        }
+
+                        try
+                        {
+                            // values, except amounts and output_info,
+                            // are tx hashes. They are replaced with tx ids.
+                            if (wdbi != D_output_info && wdbi != D_output_amounts)
+                            {
+                                crypto::hash tx_hash;
+
+                                if (old_version == 0 && !hex_to_pod(val_str, tx_hash))
+                                {
+                                    cerr << "Cant convert tx hash: " << val_str
+                                         << " in " << DBI_NAMES[wdbi] << endl;
+                                    return false;
+                                }
+
+                                if (old_version == 1)
+                                {
+                                    tx_hash = *(val.data<crypto::hash>());
+                                }
+
+                                uint64_t tx_id = get_or_add_tx_id(tx_hash);
+
+                                val_str = string(reinterpret_cast<char*>(&tx_id),
+                                                 sizeof(tx_id));
+                            }
+
+                            if (wdbi == D_output_info)
+                            {
+                                get_or_add_tx_id(val.data<output_info>()->tx_hash);
+                            }
+
+                            lmdb::val new_key {key_str};
+                            lmdb::val new_val {val_str};
+
+                            put(wdbi, new_key, new_val);
+                        }
+                        catch (lmdb::error& e)
+                        {
+                            cerr << e.what() << endl;
+                            m_map_full = e.code() == MDB_MAP_FULL;
+                            return false;
+                        }
+
+                        return true;
+                    };
+
+                    // first entry of the current write transaction, and
+                    // how many were read since. If the map gets full,
+                    // they are read again from the old dbi and written
+                    // in a new transaction.
+                    string   batch_key;
+                    string   batch_val;
+                    uint64_t batch_size {0};
+
+                    auto import_batch = [&]() -> bool
+                    {
+                        key = lmdb::val {batch_key};
+                        val = lmdb::val {batch_val};
+
+                        if (!cr.get(key, val, MDB_GET_BOTH))
+                        {
+                            return false;
+                        }
+
+                        for (uint64_t i = 0; i < batch_size; ++i)
+                        {
+                            if ((i > 0 && !cr.get(key, val, MDB_NEXT))
+                                || !import_entry())
+                            {
+                                return false;
+                            }
+                        }
+
+                        return true;
+                    };
+
+                    if (!begin_txn())
+                    {
+                        return false;
+                    }
+
+                    while (cr.get(key, val, MDB_NEXT))
+                    {
+                        if (batch_size++ == 0)
+                        {
+                            batch_key.assign(key.data(), key.size());
+                            batch_val.assign(val.data(), val.size());
+                        }
+
+                        if (!import_entry()
+                            && !(map_full() && grow_map_and_replay(import_batch)))
+                        {
+                            abort_txn();
+                            return false;
+                        }
+
+                        if (++no_entries % entries_per_txn == 0)
+                        {
+                            if (!end_txn(import_batch) || !begin_txn())
+                            {
+                                return false;
+                            }
+
+                            batch_size = 0;
+
+                            cout << " - " << no_entries << " entries" << endl;
+                        }
+                    }
+
+                    if (!end_txn(import_batch))
+                    {
+                        return false;
+                    }
+
+                    cout << " - " << no_entries << " entries" << endl;
+                }
+
+                rtxn.abort();
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Put key and value into a given dbi using the current
+         * write transaction, keeping track of its size.
+         */
+        void
+        put(const enum D_dbi wdbi, lmdb::val& key, lmdb::val& val)
+        {
+            unsigned int flags = DBI_APPEND[wdbi] ? append_flags(wdbi, key, val) : 0;
+
+            if (!m_dbis[wdbi].put(m_wtxn, key, val, flags) && flags != 0)
+            {
+                // MDB_KEYEXIST, as lmdb disagrees about the order.
+                // Should not happen, but a normal put is always fine.
+                m_dbis[wdbi].put(m_wtxn, key, val);
+            }
+
+            m_txn_size += key.size() + val.size();
+        }
+
+        /**
+         * Outputs are keyed by the height of their block, and their
+         * values start with the outputs' indices. So both keys and
+         * dups are always appended, unlike in output_info.
+         */
+        void
+        put_outputs_by_height(const tx_record& tx_rec)
+        {
+            uint64_t blk_height = tx_rec.blk_height;
+
+            lmdb::val blk_height_val {&blk_height, sizeof(blk_height)};
+
+            for (const output_info& out_info: tx_rec.outputs)
+            {
+                output_record out_rec {m_next_output_index++, out_info};
+
+                lmdb::val out_rec_val {&out_rec, sizeof(out_rec)};
+
+                put(D_output_info_by_height, blk_height_val, out_rec_val);
+            }
+        }
+
+        /**
+         * Flags for putting a given key and value into a dbi whose
+         * keys come mostly in order. Appending skips searching the
+         * tree and fills pages completely instead of splitting them
+         * in half. But it can be used only if the key is greater than
+         * the last one in the dbi (MDB_APPEND), or if it is equal
+         * and the value is greater than the last one (MDB_APPENDDUP).
+         * Otherwise, e.g., for blocks with timestamps earlier than
+         * of their predecessors, the normal put is used.
+         */
+        unsigned int
+        append_flags(const enum D_dbi wdbi,
+                     const lmdb::val& key,
+                     const lmdb::val& val)
+        {
+            append_state& last = m_append[wdbi];
+
+            if (!last.loaded)
+            {
+                lmdb::cursor cr = lmdb::cursor::open(m_wtxn, m_dbis[wdbi]);
+
+                lmdb::val last_key;
+                lmdb::val last_val;
+
+                last.empty = !cr.get(last_key, last_val, MDB_LAST);
+
+                if (!last.empty)
+                {
+                    last.key.assign(last_key.data(), last_key.size());
+                    last.val.assign(last_val.data(), last_val.size());
+                }
+
+                last.loaded = true;
+            }
+
+            unsigned int flags = 0;
+
+            if (last.empty)
+            {
+                flags = MDB_APPEND;
+            }
+            else
+            {
+                lmdb::val last_key {last.key};
+
+                int key_cmp = mdb_cmp(m_wtxn, m_dbis[wdbi], key, last_key);
+
+                if (key_cmp > 0)
+                {
+                    flags = MDB_APPEND;
+                }
+                else if (key_cmp == 0 && (DBI_FLAGS[wdbi] & MDB_DUPSORT))
+                {
+                    lmdb::val last_val {last.val};
+
+                    if (mdb_dcmp(m_wtxn, m_dbis[wdbi], val, last_val) > 0)
+                    {
+                        flags = MDB_APPENDDUP;
+                    }
+                }
+            }
+
+            if (flags == MDB_APPEND)
+            {
+                last.key.assign(key.data(), key.size());
+            }
+
+            if (flags != 0)
+            {
+                last.val.assign(val.data(), val.size());
+                last.empty = false;
+            }
+
+            return flags;
+        }
+
+        /**
+         * Keys can be given either as raw bytes, or as hex
+         * strings, e.g., as entered by a user. Returns the
+         * key in raw bytes, as it is stored in a given dbi.
+         */
+        static bool
+        to_binary_key(const string& key,
+                      const enum D_dbi rdbi,
+                      string& key_bin)
+        {
+            size_t key_size = DBI_KEY_SIZES[rdbi];
+
+            if (key.size() == key_size)
+            {
+                key_bin = key;
+                return true;
+            }
+
+            if (key.size() == 2 * key_size)
+            {
+                return epee::string_tools::parse_hexstr_to_binbuff(key, key_bin);
+            }
+
+            return false;
+        }
+
+        /**
+         * Finds ids of txs associated with a given key,
+         * e.g., key image or output public key.
+         */
+        bool
+        search(const string& key,
+               vector<uint64_t>& found_tx_ids,
+               const enum D_dbi rdbi = D_key_images)
+        {
+            string key_bin;
+
+            if (!to_binary_key(key, rdbi, key_bin))
+            {
+                cerr << "Incorrect key: " << key << endl;
+                return false;
+            }
+
+            if (rdbi == D_key_images && !might_have_key_image(key_bin.data()))
+            {
+                return false;
+            }
+
+            uint64_t snapshot_tx_id;
+
+            if (rdbi == D_key_images
+                && m_key_image_snapshot
+                && m_key_image_snapshot->find(key_bin.data(), snapshot_tx_id))
+            {
+                found_tx_ids.push_back(snapshot_tx_id);
+                return true;
+            }
+
+            try
+            {
+
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+                lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[rdbi]);
+
+                lmdb::val key_to_find{key_bin};
+                lmdb::val tx_id_val;
+
+                // set cursor the the first item
+                if (cr.get(key_to_find, tx_id_val, MDB_SET))
+                {
+                    found_tx_ids.push_back(*(tx_id_val.data<uint64_t>()));
+
+                    // process other values for the same key
+                    while (cr.get(key_to_find, tx_id_val, MDB_NEXT_DUP))
+                    {
+                        found_tx_ids.push_back(*(tx_id_val.data<uint64_t>()));
+                    }
+                }
+                else
+                {
+                    return false;
+                }
+
+                cr.close();
+            }
+            catch (lmdb::error& e)
+            {
+                cerr << e.what() << endl;
+                return false;
+            }
+
             return true;
         }
 
+        /**
+         * Finds hashes of txs associated with a given key.
+         */
         bool
-        write_output_public_keys(const transaction& tx, const block& blk)
+        search(const string& key,
+               vector<crypto::hash>& found_tx_hashes,
+               const enum D_dbi rdbi = D_key_images)
         {
-            crypto::hash tx_hash = get_transaction_hash(tx);
+            vector<uint64_t> found_tx_ids;
 
-            crypto::public_key tx_pub_key = get_tx_pub_key_from_extra(tx);
-
-            string tx_hash_str = pod_to_hex(tx_hash);
-
-            vector<tuple<txout_to_key, uint64_t, uint64_t>> outputs =
-                    xmreg::get_ouputs_tuple(tx);
-
-            for (auto& output: outputs)
+            if (!search(key, found_tx_ids, rdbi))
             {
+                return false;
+            }
 
-                public_key out_pub_key = std::get<0>(output).key;
-
-                string public_key_str = pod_to_hex(out_pub_key);
-
-                lmdb::val public_key_val {public_key_str};
-                lmdb::val tx_hash_val    {tx_hash_str};
-
-                uint64_t amount = std::get<1>(output);
-
-                lmdb::val amount_val     {static_cast<void*>(&amount), sizeof(amount)};
-
-                uint64_t index_in_tx = std::get<2>(output);
-
-                output_info out_info {out_pub_key, tx_hash,
-                                      tx_pub_key, amount,
-                                      index_in_tx};
-
-                uint64_t out_timestamp = blk.timestamp;
+            for (uint64_t tx_id: found_tx_ids)
+            {
+                crypto::hash tx_hash;
 
-                lmdb::val out_timestamp_val     {static_cast<void*>(&out_timestamp),
-                                                 sizeof(out_timestamp)};
-                lmdb::val out_info_val          {static_cast<void*>(&out_info),
-                                                 sizeof(out_info)};
+                if (!get_tx_hash(tx_id, tx_hash))
+                {
+                    return false;
+                }
 
-                m_dbis[D_output_public_keys].put(m_wtxn, public_key_val, tx_hash_val);
-                m_dbis[D_output_amounts].put(m_wtxn, public_key_val, amount_val);
-                m_dbis[D_output_info].put(m_wtxn, out_timestamp_val, out_info_val);
+                found_tx_hashes.push_back(tx_hash);
             }
 
             return true;
         }
 
         bool
-        write_tx_public_key(const transaction& tx)
+        get_tx_hash(uint64_t tx_id, crypto::hash& tx_hash)
         {
-            crypto::hash tx_hash = get_transaction_hash(tx);
-
-            string tx_hash_str = pod_to_hex(tx_hash);
-
-            public_key pk = get_tx_pub_key_from_extra(tx);
-
-            string pk_str = pod_to_hex(pk);
-
             try
             {
-                //cout << "Saving public_key: " << pk_str << endl;
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
-                lmdb::val public_key_val {pk_str};
-                lmdb::val tx_hash_val    {tx_hash_str};
-
-                m_dbis[D_tx_public_keys].put(m_wtxn, public_key_val, tx_hash_val);
+                if (!m_dbis[D_tx_ids].get(rtxn, tx_id, tx_hash))
+                {
+                    return false;
+                }
             }
             catch (lmdb::error& e)
             {
@@ -266,32 +1801,17 @@ namespace xmreg
         }
 
         bool
-        write_payment_id(const transaction& tx)
+        get_tx_id(const crypto::hash& tx_hash, uint64_t& tx_id)
         {
-            crypto::hash tx_hash = get_transaction_hash(tx);
-
-            string tx_hash_str = pod_to_hex(tx_hash);
-
-            crypto::hash  payment_id;
-            crypto::hash8 payment_id8;
-
-            get_payment_id(tx, payment_id, payment_id8);
-
-            if (payment_id == null_hash)
-            {
-                return true;
-            }
-
-            string payment_id_str = pod_to_hex(payment_id);
-
             try
             {
-                //cout << "Saving payiment_id: " << payment_id_str << endl;
-
-                lmdb::val payment_id_val {payment_id_str};
-                lmdb::val tx_hash_val    {tx_hash_str};
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
-                m_dbis[D_payments_id].put(m_wtxn, payment_id_val, tx_hash_val);
+                if (!m_dbis[D_tx_hashes].get(rtxn, tx_hash, tx_id))
+                {
+                    return false;
+                }
             }
             catch (lmdb::error& e)
             {
@@ -302,113 +1822,127 @@ namespace xmreg
             return true;
         }
 
+        /**
+         * Search using key given as crypto object,
+         * e.g., crypto::key_image or crypto::public_key.
+         */
+        template <typename T, typename R>
         bool
-        write_encrypted_payment_id(const transaction& tx)
+        search(const T& key,
+               vector<R>& found_txs,
+               const enum D_dbi rdbi = D_key_images)
         {
-            crypto::hash tx_hash = get_transaction_hash(tx);
-
-            string tx_hash_str = pod_to_hex(tx_hash);
+            return search(string(reinterpret_cast<const char*>(&key), sizeof(T)),
+                          found_txs, rdbi);
+        }
 
-            crypto::hash  payment_id;
-            crypto::hash8 payment_id8;
+        /**
+         * Finds ids of txs associated with each of the given keys,
+         * e.g., thousands of key images from a wallet.
+         *
+         * Instead of descending the B-tree from its root for every
+         * key, the keys are sorted and a single cursor is moved
+         * forward through them using MDB_SET_RANGE, in one read txn.
+         * Since consecutive keys are often on the same or on the
+         * next page, this is mostly a sequential pass.
+         *
+         * Keys not found in the dbi are not present in found_tx_ids.
+         * Returns false only if a key is incorrect or lmdb fails.
+         */
+        bool
+        search_many(const vector<string>& keys,
+                    map<string, vector<uint64_t>>& found_tx_ids,
+                    const enum D_dbi rdbi = D_key_images)
+        {
+            // binary key and index of the key as given
+            vector<pair<string, size_t>> probes;
 
-            get_payment_id(tx, payment_id, payment_id8);
+            probes.reserve(keys.size());
 
-            if (payment_id8 == null_hash8)
+            for (size_t i = 0; i < keys.size(); ++i)
             {
-                return true;
+                string key_bin;
+
+                if (!to_binary_key(keys[i], rdbi, key_bin))
+                {
+                    cerr << "Incorrect key: " << keys[i] << endl;
+                    return false;
+                }
+
+                probes.emplace_back(std::move(key_bin), i);
             }
 
-            string payment_id_str = pod_to_hex(payment_id8);
+            // lmdb compares keys as bytes, same as std::string does
+            std::sort(probes.begin(), probes.end());
 
             try
             {
-                //cout << "Saving encrypted payiment_id: " << payment_id_str << endl;
-                //string wait_for_enter;
-                //cin >> wait_for_enter;
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+                lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[rdbi]);
 
-                lmdb::val payment_id_val {payment_id_str};
-                lmdb::val tx_hash_val    {tx_hash_str};
+                lmdb::val key_val;
+                lmdb::val tx_id_val;
 
-                m_dbis[D_encrypted_payments_id].put(m_wtxn, payment_id_val, tx_hash_val);
-            }
-            catch (lmdb::error& e)
-            {
-                cerr << e.what() << endl;
-                return false;
-            }
+                for (size_t i = 0; i < probes.size(); ++i)
+                {
+                    const string& key_bin = probes[i].first;
 
-            return true;
-        }
+                    // same key given more than once, e.g., as hex and bin
+                    if (i > 0 && key_bin == probes[i - 1].first)
+                    {
+                        auto prev = found_tx_ids.find(keys[probes[i - 1].second]);
 
-//        // this seems to be not needed as outputs are written based on timestamps
-//
-//        bool
-//        write_block_timestamp(uint64_t& blk_timestamp, uint64_t& blk_height)
-//        {
-//
-//            unsigned int flags = MDB_CREATE | MDB_INTEGERKEY;
-//
-//            try
-//            {
-//                lmdb::txn wtxn = lmdb::txn::begin(m_env);
-//                lmdb::dbi wdbi = lmdb::dbi::open(wtxn, "block_timestamps", flags);
-//
-//                lmdb::val blk_timestamp_val {static_cast<void*>(&blk_timestamp),
-//                                             sizeof(blk_timestamp)};
-//                lmdb::val blk_height_val    {static_cast<void*>(&blk_height),
-//                                             sizeof(blk_height)};
-//
-//                wdbi.put(wtxn, blk_timestamp_val, blk_height_val);
-//
-//                wtxn.commit();
-//            }
-//            catch (lmdb::error& e)
-//            {
-//                cerr << e.what() << endl;
-//                return false;
-//            }
-//
-//            return true;
-//        }
+                        if (prev != found_tx_ids.end())
+                        {
+                            found_tx_ids[keys[probes[i].second]] = prev->second;
+                        }
 
-        bool
-        search(const string& key,
-               vector<string>& found_tx_hashes,
-               const enum D_dbi rdbi = D_key_images)
-        {
-            unsigned int flags = MDB_DUPSORT | MDB_DUPFIXED;
+                        continue;
+                    }
 
-            try
-            {
+                    if (rdbi == D_key_images && !might_have_key_image(key_bin.data()))
+                    {
+                        continue;
+                    }
 
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
-                lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[rdbi]);
+                    uint64_t snapshot_tx_id;
 
-                lmdb::val key_to_find{key};
-                lmdb::val tx_hash_val;
+                    if (rdbi == D_key_images
+                        && m_key_image_snapshot
+                        && m_key_image_snapshot->find(key_bin.data(), snapshot_tx_id))
+                    {
+                        found_tx_ids[keys[probes[i].second]].push_back(snapshot_tx_id);
+                        continue;
+                    }
 
-                // set cursor the the first item
-                if (cr.get(key_to_find, tx_hash_val, MDB_SET))
-                {
-                    //cout << key_val_to_str(key_to_find, tx_hash_val) << endl;
-                    found_tx_hashes.push_back(string(tx_hash_val.data(), tx_hash_val.size()));
+                    key_val = lmdb::val {key_bin};
 
-                    // process other values for the same key
-                    while (cr.get(key_to_find, tx_hash_val, MDB_NEXT_DUP))
+                    // first key equal or greater than the one we look for
+                    if (!cr.get(key_val, tx_id_val, MDB_SET_RANGE))
                     {
-                        //cout << key_val_to_str(key_to_find, tx_hash_val) << endl;
-                        found_tx_hashes.push_back(string(tx_hash_val.data(), tx_hash_val.size()));
+                        // all remaining keys are past the last one in the dbi
+                        break;
+                    }
+
+                    if (key_val.size() != key_bin.size()
+                        || std::memcmp(key_val.data(), key_bin.data(),
+                                       key_bin.size()) != 0)
+                    {
+                        continue;
+                    }
+
+                    vector<uint64_t>& tx_ids = found_tx_ids[keys[probes[i].second]];
+
+                    tx_ids.push_back(*(tx_id_val.data<uint64_t>()));
+
+                    while (cr.get(key_val, tx_id_val, MDB_NEXT_DUP))
+                    {
+                        tx_ids.push_back(*(tx_id_val.data<uint64_t>()));
                     }
-                }
-                else
-                {
-                    return false;
                 }
 
                 cr.close();
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -425,14 +1959,21 @@ namespace xmreg
                           const enum D_dbi rdbi = D_output_amounts)
         {
 
-            unsigned int flags = 0;
+            string key_bin;
+
+            if (!to_binary_key(key, rdbi, key_bin))
+            {
+                cerr << "Incorrect key: " << key << endl;
+                return false;
+            }
 
             try
             {
 
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
-                lmdb::val key_to_find{key};
+                lmdb::val key_to_find{key_bin};
                 lmdb::val amount_val;
 
                 if(!m_dbis[rdbi].get(rtxn, key_to_find, amount_val))
@@ -441,9 +1982,6 @@ namespace xmreg
                 }
 
                 amount = *(amount_val.data<uint64_t>());
-
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -466,7 +2004,8 @@ namespace xmreg
             try
             {
 
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
                 lmdb::val key_to_find{static_cast<void*>(&key_timestamp),
                                       sizeof(key_timestamp)};
@@ -490,9 +2029,6 @@ namespace xmreg
                 {
                     return false;
                 }
-
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -514,7 +2050,8 @@ namespace xmreg
 
             try
             {
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
 
                 lmdb::val key_to_find{static_cast<void*>(&key_timestamp_start),
                                       sizeof(key_timestamp_start)};
@@ -558,9 +2095,6 @@ namespace xmreg
                 {
                     return false;
                 }
-
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -571,6 +2105,130 @@ namespace xmreg
             return true;
         }
 
+        /**
+         * Read-only snapshot of the database, taken from the pool
+         * of this thread's txns. Used by all queries, and by callers
+         * of the *_view queries, whose results point into lmdb's
+         * memory map, so the guard must be kept for as long as
+         * they are used.
+         */
+        read_txn_guard
+        begin_read()
+        {
+            return m_rtxn_pool->snapshot();
+        }
+
+        /**
+         * Frees the read-only txn kept for the calling thread,
+         * e.g., before the thread finishes.
+         */
+        void
+        release_read_txn()
+        {
+            m_rtxn_pool->release_this_thread();
+        }
+
+        /**
+         * Ids of txs associated with a given key, as a range
+         * of views, without copying them into a vector.
+         *
+         * Throws std::invalid_argument if the key is incorrect.
+         */
+        mdb_range<uint64_t>
+        search_view(read_txn_guard& guard,
+                    const string& key,
+                    const enum D_dbi rdbi = D_key_images)
+        {
+            string key_bin;
+
+            if (!to_binary_key(key, rdbi, key_bin))
+            {
+                throw std::invalid_argument("Incorrect key: " + key);
+            }
+
+            return mdb_range<uint64_t>::dups_of(guard.txn(), m_dbis[rdbi],
+                                                key_bin.data(),
+                                                key_bin.size());
+        }
+
+        /**
+         * Outputs with timestamps in [key_timestamp_start, key_timestamp_end],
+         * as a range of views. Timestamp of each output is given by
+         * key_as_uint64() of its view.
+         */
+        mdb_range<output_info>
+        output_info_view(read_txn_guard& guard,
+                         uint64_t key_timestamp_start,
+                         uint64_t key_timestamp_end)
+        {
+            return mdb_range<output_info>::key_range(guard.txn(),
+                                                     m_dbis[D_output_info],
+                                                     key_timestamp_start,
+                                                     key_timestamp_end);
+        }
+
+        /**
+         * Outputs in blocks of heights in [blk_height_start, blk_height_end],
+         * in the order they are in the blockchain, as a range of views.
+         * Height of each output is given by key_as_uint64() of its view.
+         *
+         * Unlike with timestamps, which are not unique nor increasing,
+         * this gives exactly the outputs of given blocks.
+         */
+        mdb_range<output_record>
+        outputs_by_height_view(read_txn_guard& guard,
+                               uint64_t blk_height_start,
+                               uint64_t blk_height_end)
+        {
+            return mdb_range<output_record>::key_range(
+                    guard.txn(), m_dbis[D_output_info_by_height],
+                    blk_height_start, blk_height_end);
+        }
+
+        /**
+         * Height of the first block with timestamp equal or greater
+         * than a given one. Returns false if there is no such block.
+         */
+        bool
+        height_at_or_after(uint64_t timestamp, uint64_t& blk_height)
+        {
+            lock_guard<mutex> lock(m_blk_timestamps_mutex);
+
+            if (!load_block_timestamps())
+            {
+                return false;
+            }
+
+            blk_height = m_blk_timestamps.height_at_or_after(timestamp);
+
+            return blk_height < m_blk_timestamps.size();
+        }
+
+        /**
+         * Heights [blk_height_start, blk_height_end) of blocks spanning
+         * timestamps [timestamp_start, timestamp_end]. Returns false
+         * if there are no such blocks.
+         */
+        bool
+        height_range(uint64_t timestamp_start,
+                     uint64_t timestamp_end,
+                     uint64_t& blk_height_start,
+                     uint64_t& blk_height_end)
+        {
+            lock_guard<mutex> lock(m_blk_timestamps_mutex);
+
+            if (!load_block_timestamps())
+            {
+                return false;
+            }
+
+            std::tie(blk_height_start, blk_height_end)
+                    = m_blk_timestamps.height_range(timestamp_start,
+                                                    timestamp_end);
+
+            return blk_height_start < blk_height_end;
+        }
+
         /**
          * Returns sorted and unique tx hashes withing a
          * given timestamp range
@@ -626,7 +2284,8 @@ namespace xmreg
             try
             {
 
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
                 lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[D_output_info]);
 
                 lmdb::val key_to_find;
@@ -636,13 +2295,10 @@ namespace xmreg
                 // process all values for the same key
                 while (cr.get(key_to_find, amount_val, MDB_NEXT))
                 {
-                    public_key pub_key;
-
-                    hex_to_pod(string(key_to_find.data(), key_to_find.size()),
-                               pub_key);
-
                     output_info out_info =  *(amount_val.data<output_info>());
 
+                    public_key pub_key = out_info.out_pub_key;
+
                     if (f(pub_key, out_info) == false)
                     {
                         break;
@@ -650,8 +2306,6 @@ namespace xmreg
                 }
 
                 cr.close();
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -668,7 +2322,8 @@ namespace xmreg
             try
             {
 
-                lmdb::txn rtxn  = lmdb::txn::begin(m_env, nullptr, MDB_RDONLY);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
                 lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[rdbi]);
 
                 lmdb::val key_to_find;
@@ -682,8 +2337,6 @@ namespace xmreg
                 }
 
                 cr.close();
-                rtxn.abort();
-
             }
             catch (lmdb::error& e)
             {
@@ -691,49 +2344,130 @@ namespace xmreg
             }
         }
 
-        static uint64_t
-        get_blockchain_height(string blk_path = "/home/mwo/.blockchain/lmdb")
+        string
+        key_val_to_str(const lmdb::val& key, const lmdb::val& val)
+        {
+            using epee::string_tools::buff_to_hex_nodelimer;
+
+            return "key: "     + buff_to_hex_nodelimer(string(key.data(), key.size()))
+                   + ", val: " + buff_to_hex_nodelimer(string(val.data(), val.size()));
+        }
+
+    private:
+
+        /**
+         * Builds the key image filter again from all key images
+         * in key_images, for twice as many of them.
+         */
+        void
+        build_key_image_filter(lmdb::txn& rtxn, uint64_t no_keys)
+        {
+            uint64_t capacity = MIN_KEY_IMAGE_FILTER_CAPACITY;
+
+            unique_ptr<KeyImageFilter> filter {
+                    new KeyImageFilter(std::max(2 * no_keys, capacity),
+                                       m_key_image_filter_fp_rate)};
+
+            lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[D_key_images]);
+
+            lmdb::val key_image_val;
+            lmdb::val tx_id_val;
+
+            // each key image once, even if it has many tx ids
+            while (cr.get(key_image_val, tx_id_val, MDB_NEXT_NODUP))
+            {
+                if (key_image_val.size() != KeyImageFilter::KEY_SIZE)
+                {
+                    continue;
+                }
+
+                filter->insert(key_image_val.data());
+            }
+
+            cr.close();
+
+            m_key_image_filter = std::move(filter);
+        }
+
+        string
+        key_image_filter_path() const
+        {
+            return m_db_path + "/key_images.filter";
+        }
+
+        string
+        key_image_snapshot_path() const
         {
-            uint64_t height {0};
+            return m_db_path + "/key_images.snapshot";
+        }
 
+        /**
+         * Reads timestamps of blocks committed since
+         * the last call into m_blk_timestamps.
+         */
+        bool
+        load_block_timestamps()
+        {
             try
             {
-                auto env = lmdb::env::create();
-                env.set_mapsize(DEFAULT_MAPSIZE * 3);
-                env.set_max_dbs(20);
-                env.open(blk_path.c_str(), MDB_CREATE, 0664);
+                read_txn_guard snapshot = begin_read();
+                lmdb::txn& rtxn = snapshot.txn();
+
+                uint64_t next_height = m_blk_timestamps.size();
 
-                auto rtxn = lmdb::txn::begin(env, nullptr, MDB_RDONLY);
-                auto rdbi = lmdb::dbi::open(rtxn, "blocks");
+                uint64_t no_blocks = m_dbis[D_block_timestamps].size(rtxn);
 
-                MDB_stat stats = rdbi.stat(rtxn);
+                if (no_blocks <= next_height)
+                {
+                    return true;
+                }
 
-                height = static_cast<uint64_t>(stats.ms_entries);
+                m_blk_timestamps.reserve(no_blocks);
 
-                rtxn.abort();
+                lmdb::cursor cr = lmdb::cursor::open(rtxn, m_dbis[D_block_timestamps]);
+
+                lmdb::val blk_height_val {&next_height, sizeof(next_height)};
+                lmdb::val blk_timestamp_val;
+
+                MDB_cursor_op op = MDB_SET_RANGE;
+
+                while (cr.get(blk_height_val, blk_timestamp_val, op))
+                {
+                    if (*blk_height_val.data<uint64_t>() != m_blk_timestamps.size())
+                    {
+                        // heights must follow each other
+                        break;
+                    }
+
+                    m_blk_timestamps.push_back(*blk_timestamp_val.data<uint64_t>());
+
+                    op = MDB_NEXT;
+                }
+
+                cr.close();
             }
             catch (lmdb::error& e)
             {
                 cerr << e.what() << endl;
-                return height;
-            }
-            catch (exception& e)
-            {
-                cerr << e.what() << endl;
-                return height;
+                return false;
             }
 
-            //cout << height << endl;
-
-            return height;
-
+            return true;
         }
 
-        string
-        key_val_to_str(const lmdb::val& key, const lmdb::val& val)
+        static bool
+        has_dbi(lmdb::txn& txn, const char* name)
         {
-            return "key: "     + string(key.data(), key.size())
-                   + ", val: " + string(val.data(), val.size());
+            try
+            {
+                lmdb::dbi::open(txn, name, 0);
+            }
+            catch (lmdb::not_found_error& e)
+            {
+                return false;
+            }
+
+            return true;
         }
 
 
@@ -0,0 +1,68 @@
+#ifndef XMRLMDBCPP_PARALLEL_H
+#define XMRLMDBCPP_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace xmreg
+{
+    using namespace std;
+
+    /**
+     * Runs task(0), task(1), ..., task(no_tasks - 1) on no_threads
+     * threads, and returns when all are done.
+     *
+     * Threads take the next task from a shared counter as soon as
+     * they finish the previous one, so no thread stays idle while
+     * there are tasks left, even if some tasks take longer than
+     * others. at_thread_exit, if given, is called by each thread
+     * once there are no more tasks, e.g., to free per-thread
+     * resources.
+     */
+    inline void
+    parallel_for(size_t no_tasks,
+                 size_t no_threads,
+                 const std::function<void(size_t)>& task,
+                 const std::function<void()>& at_thread_exit = nullptr)
+    {
+        no_threads = std::max<size_t>(std::min(no_threads, no_tasks), 1);
+
+        atomic<size_t> next_task {0};
+
+        auto worker = [&]()
+        {
+            size_t task_idx;
+
+            while ((task_idx = next_task++) < no_tasks)
+            {
+                task(task_idx);
+            }
+
+            if (at_thread_exit)
+            {
+                at_thread_exit();
+            }
+        };
+
+        vector<thread> threads;
+
+        // calling thread is one of the workers
+        for (size_t i = 1; i < no_threads; ++i)
+        {
+            threads.emplace_back(worker);
+        }
+
+        worker();
+
+        for (thread& t: threads)
+        {
+            t.join();
+        }
+    }
+
+}
+
+#endif //XMRLMDBCPP_PARALLEL_H
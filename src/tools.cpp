@@ -3,6 +3,7 @@
 //
 
 #include "tools.h"
+#include "parallel.h"
 #include <codecvt>
 
 
@@ -523,8 +524,11 @@ namespace xmreg
 
 
     /**
-     * Rough estimate of block height from the time provided
+     * Rough estimate of block height from the time provided,
+     * for mainnet, assuming blocks are never late nor early.
      *
+     * Exact heights of indexed blocks are given by
+     * MyLMDB::height_at_or_after.
      */
     uint64_t
     estimate_bc_height(const string& date, const char* format)
@@ -532,6 +536,11 @@ namespace xmreg
         const pt::ptime MONERO_START {gt::date(2014,04,18)};
         const uint64_t MONERO_BLOCK_TIME {60}; // seconds
 
+        // since hard fork v2, blocks are twice as long
+        const pt::ptime MONERO_V2_START {gt::date(2016,03,23)};
+        const uint64_t MONERO_V2_HEIGHT {1009827};
+        const uint64_t MONERO_V2_BLOCK_TIME {120}; // seconds
+
         dateparser parser {format};
 
         if (!parser(date))
@@ -546,6 +555,14 @@ namespace xmreg
             return 0;
         }
 
+        if (requested_date >= MONERO_V2_START)
+        {
+            pt::time_duration td = requested_date - MONERO_V2_START;
+
+            return MONERO_V2_HEIGHT
+                   + static_cast<uint64_t>(td.total_seconds()) / MONERO_V2_BLOCK_TIME;
+        }
+
         pt::time_duration td = requested_date - MONERO_START;
 
         return static_cast<uint64_t>(td.total_seconds()) / MONERO_BLOCK_TIME;
@@ -654,40 +671,245 @@ namespace xmreg
             return false;
         }
 
+        return decode_ringct(rv, derivation, i, mask, amount);
+    }
+
+    /**
+     * Decodes amount and mask of i-th output of a RingCT tx,
+     * using already generated key derivation of the tx.
+     *
+     * Same as rct::decodeRct and rct::decodeRctSimple, but uses
+     * only ecdhInfo and outPk, i.e., the base of the signatures.
+     * So it works also for txs parsed by parse_tx_prefix_from_blob,
+     * which dont have range proofs the rct functions check for.
+     */
+    bool
+    decode_ringct(const rct::rctSig& rv,
+                  const crypto::key_derivation& derivation,
+                  unsigned int i,
+                  rct::key & mask,
+                  uint64_t & amount)
+    {
+        if (rv.type != rct::RCTTypeSimple && rv.type != rct::RCTTypeFull)
+        {
+            cerr << "Unsupported rct type: " << rv.type << endl;
+            return false;
+        }
+
+        if (i >= rv.ecdhInfo.size() || i >= rv.outPk.size())
+        {
+            cerr << "Failed to decode output " << i << ": no such output" << endl;
+            return false;
+        }
+
         crypto::secret_key scalar1;
 
         crypto::derivation_to_scalar(derivation, i, scalar1);
 
-        try
+        rct::ecdhTuple ecdh_info = rv.ecdhInfo[i];
+
+        rct::ecdhDecode(ecdh_info, rct::sk2rct(scalar1));
+
+        // decoded mask and amount must give the output's commitment,
+        // otherwise the output is not ours, or was decoded wrong
+        rct::key commitment;
+
+        rct::addKeys2(commitment, ecdh_info.mask, ecdh_info.amount, rct::H);
+
+        if (!rct::equalKeys(commitment, rv.outPk[i].mask))
         {
-            switch (rv.type)
+            cerr << "Failed to decode output " << i << endl;
+            return false;
+        }
+
+        mask   = ecdh_info.mask;
+        amount = rct::h2d(ecdh_info.amount);
+
+        return true;
+    }
+
+    /**
+     * Decodes masks and amounts of many RingCT outputs, e.g., all
+     * found by a scan, grouped by their txs. Key derivation is
+     * generated only once per tx, and txs are decoded in parallel.
+     *
+     * Returns one ringct_decoded for each output, in the order of
+     * the txs and their output_indices. Outputs which cant be
+     * decoded are marked as such, and dont stop the others.
+     */
+    vector<ringct_decoded>
+    decode_ringct_batch(const vector<ringct_batch_tx>& txs,
+                        size_t no_threads)
+    {
+        // position of the first output of each tx in the results
+        vector<size_t> offsets(txs.size());
+
+        size_t no_outputs {0};
+
+        for (size_t i = 0; i < txs.size(); ++i)
+        {
+            offsets[i]  = no_outputs;
+            no_outputs += txs[i].output_indices.size();
+        }
+
+        vector<ringct_decoded> decoded(no_outputs,
+                                       ringct_decoded {rct::key {}, 0, false});
+
+        parallel_for(txs.size(), no_threads, [&](size_t tx_idx)
+        {
+            const ringct_batch_tx& tx = txs[tx_idx];
+
+            crypto::key_derivation derivation;
+
+            if (!crypto::generate_key_derivation(tx.tx_pub_key,
+                                                 tx.private_view_key,
+                                                 derivation))
             {
-                case rct::RCTTypeSimple:
-                    amount = rct::decodeRctSimple(rv,
-                                                  rct::sk2rct(scalar1),
-                                                  i,
-                                                  mask);
-                    break;
-                case rct::RCTTypeFull:
-                    amount = rct::decodeRct(rv,
-                                            rct::sk2rct(scalar1),
-                                            i,
-                                            mask);
-                    break;
-                default:
-                    cerr << "Unsupported rct type: " << rv.type << endl;
-                    return false;
+                return;
             }
+
+            for (size_t j = 0; j < tx.output_indices.size(); ++j)
+            {
+                ringct_decoded& out = decoded[offsets[tx_idx] + j];
+
+                out.decoded = decode_ringct(*tx.rv, derivation,
+                                            tx.output_indices[j],
+                                            out.mask, out.amount);
+            }
+        });
+
+        return decoded;
+    }
+
+
+    namespace
+    {
+        // read-only stream buffer over bytes, e.g., in
+        // lmdb's memory map, so that they can be parsed
+        // without being copied into a stringstream first.
+        //
+        // It must be seekable, as binary_archive finds size
+        // of its input with tellg and seekg to its end, and
+        // checks sizes of vectors against what remains.
+        struct membuf : std::streambuf
+        {
+            membuf(const char* data, size_t size)
+            {
+                char* begin = const_cast<char*>(data);
+                setg(begin, begin, begin + size);
+            }
+
+            pos_type
+            seekoff(off_type off,
+                    std::ios_base::seekdir dir,
+                    std::ios_base::openmode which = std::ios_base::in) override
+            {
+                if (!(which & std::ios_base::in))
+                {
+                    return pos_type(off_type(-1));
+                }
+
+                char* base;
+
+                if (dir == std::ios_base::beg)
+                {
+                    base = eback();
+                }
+                else if (dir == std::ios_base::cur)
+                {
+                    base = gptr();
+                }
+                else
+                {
+                    base = egptr();
+                }
+
+                if (off < eback() - base || off > egptr() - base)
+                {
+                    return pos_type(off_type(-1));
+                }
+
+                setg(eback(), base + off, egptr());
+
+                return pos_type(off_type(gptr() - eback()));
+            }
+
+            pos_type
+            seekpos(pos_type pos,
+                    std::ios_base::openmode which = std::ios_base::in) override
+            {
+                return seekoff(off_type(pos), std::ios_base::beg, which);
+            }
+
+            // bytes read so far
+            size_t
+            pos() const
+            {
+                return static_cast<size_t>(gptr() - eback());
+            }
+        };
+    }
+
+    /**
+     * Parses only parts of a tx needed for indexing and scanning,
+     * i.e., its prefix (inputs, outputs and extra), and for RingCT
+     * txs, the base of their signatures (type, fee, ecdhInfo and
+     * outPk). Ring signatures, MLSAGs and range proofs, which
+     * make up most of a tx, are skipped.
+     *
+     * Hash of the tx cant be calculated from what is parsed.
+     * It must be taken from elsewhere, e.g., block's tx_hashes,
+     * or from hashes of the parsed bytes, whose sizes are returned
+     * in prefix_size and base_size (0 for txs without RingCT).
+     */
+    bool
+    parse_tx_prefix_from_blob(const char* data, size_t size, transaction& tx,
+                              size_t* prefix_size, size_t* base_size)
+    {
+        membuf buf(data, size);
+        std::istream is(&buf);
+
+        binary_archive<false> ba(is);
+
+        tx.set_null();
+
+        // not ::serialization::serialize, as it fails
+        // unless the whole blob is read
+        if (!::do_serialize(ba, static_cast<transaction_prefix&>(tx)) || !is.good())
+        {
+            return false;
         }
-        catch (const std::exception &e)
+
+        size_t prefix_end = buf.pos();
+
+        if (tx.version > 1
+            && (!tx.rct_signatures.serialize_rctsig_base(ba, tx.vin.size(),
+                                                          tx.vout.size())
+                || !is.good()))
         {
-            cerr << "Failed to decode input " << i << endl;
             return false;
         }
 
+        if (prefix_size)
+        {
+            *prefix_size = prefix_end;
+        }
+
+        if (base_size)
+        {
+            *base_size = buf.pos() - prefix_end;
+        }
+
         return true;
     }
 
+
+    bool
+    parse_tx_prefix_from_blob(const blobdata& tx_blob, transaction& tx)
+    {
+        return parse_tx_prefix_from_blob(tx_blob.data(), tx_blob.size(), tx);
+    }
+
     bool
     url_decode(const std::string& in, std::string& out)
     {
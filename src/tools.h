@@ -220,6 +220,48 @@ namespace xmreg
                   rct::key & mask,
                   uint64_t & amount);
 
+    bool
+    decode_ringct(const rct::rctSig & rv,
+                  const crypto::key_derivation& derivation,
+                  unsigned int i,
+                  rct::key & mask,
+                  uint64_t & amount);
+
+    /**
+     * RingCT outputs of a tx to be decoded by decode_ringct_batch,
+     * using a private view key of their owner.
+     */
+    struct ringct_batch_tx
+    {
+        const rct::rctSig*   rv;
+        crypto::public_key   tx_pub_key;
+        crypto::secret_key   private_view_key;
+        vector<unsigned int> output_indices;
+    };
+
+    /**
+     * Mask and amount of a decoded RingCT output.
+     * decoded is false if the output could not be decoded.
+     */
+    struct ringct_decoded
+    {
+        rct::key mask;
+        uint64_t amount;
+        bool     decoded;
+    };
+
+    vector<ringct_decoded>
+    decode_ringct_batch(const vector<ringct_batch_tx>& txs,
+                        size_t no_threads = 1);
+
+    bool
+    parse_tx_prefix_from_blob(const char* data, size_t size, transaction& tx,
+                              size_t* prefix_size = nullptr,
+                              size_t* base_size = nullptr);
+
+    bool
+    parse_tx_prefix_from_blob(const blobdata& tx_blob, transaction& tx);
+
     bool
     url_decode(const std::string& in, std::string& out);
 